@@ -0,0 +1,169 @@
+/*****************************************************************************
+ * AudioRing.cpp: Contiguous, sample indexed audio ring buffer
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "AudioRing.hpp"
+
+AudioRing::AudioRing()
+    : m_memory( nullptr )
+    , m_bytes( 0 )
+    , m_frameBytes( 0 )
+    , m_capacity( 0 )
+    , m_mirrored( false )
+    , m_head( 0 )
+    , m_tail( 0 )
+{
+}
+
+AudioRing::~AudioRing()
+{
+    release();
+}
+
+void AudioRing::release()
+{
+    if ( m_memory == nullptr )
+        return;
+    if ( m_mirrored == true )
+        munmap( m_memory, 2 * m_bytes );
+    else
+        free( m_memory );
+    m_memory = nullptr;
+}
+
+bool AudioRing::reset( size_t frameBytes, size_t samples )
+{
+    release();
+    m_head = 0;
+    m_tail = 0;
+    m_capacity = 0;
+    if ( frameBytes == 0 || samples == 0 )
+        return false;
+
+    // Both halves must start on a page and hold whole samples.
+    const size_t page = sysconf( _SC_PAGESIZE );
+    size_t unit = page;
+    while ( unit % frameBytes != 0 )
+        unit += page;
+    m_bytes = ( samples * frameBytes + unit - 1 ) / unit * unit;
+    m_frameBytes = frameBytes;
+
+    m_mirrored = false;
+#if defined( __linux__ ) && defined( SYS_memfd_create )
+    int fd = syscall( SYS_memfd_create, "mlt-vlc-audio", 0 );
+    if ( fd >= 0 )
+    {
+        void* base = MAP_FAILED;
+        if ( ftruncate( fd, m_bytes ) == 0 )
+            base = mmap( NULL, 2 * m_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( base != MAP_FAILED )
+        {
+            auto memory = reinterpret_cast<uint8_t*>( base );
+            if ( mmap( memory, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0 ) != MAP_FAILED &&
+                 mmap( memory + m_bytes, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0 ) != MAP_FAILED )
+            {
+                m_memory = memory;
+                m_mirrored = true;
+            }
+            else
+                munmap( base, 2 * m_bytes );
+        }
+        close( fd );
+    }
+#endif
+    if ( m_memory == nullptr )
+        m_memory = reinterpret_cast<uint8_t*>( malloc( 2 * m_bytes ) );
+    if ( m_memory == nullptr )
+        return false;
+
+    m_capacity = m_bytes / m_frameBytes;
+    return true;
+}
+
+size_t AudioRing::frameBytes() const
+{
+    return m_frameBytes;
+}
+
+size_t AudioRing::capacity() const
+{
+    return m_capacity;
+}
+
+size_t AudioRing::size() const
+{
+    return m_head.load( std::memory_order_acquire ) - m_tail.load( std::memory_order_acquire );
+}
+
+uint8_t* AudioRing::writePointer( size_t samples )
+{
+    const int64_t head = m_head.load( std::memory_order_relaxed );
+    if ( head - m_tail.load( std::memory_order_acquire ) + samples > m_capacity )
+        return nullptr;
+    return m_memory + ( head % m_capacity ) * m_frameBytes;
+}
+
+void AudioRing::commit( size_t samples )
+{
+    const int64_t head = m_head.load( std::memory_order_relaxed );
+    if ( m_mirrored == false )
+    {
+        // Keep both halves identical by hand.
+        const size_t start = ( head % m_capacity ) * m_frameBytes;
+        const size_t end = start + samples * m_frameBytes;
+        memcpy( m_memory + start + m_bytes, m_memory + start, std::min( end, m_bytes ) - start );
+        if ( end > m_bytes )
+            memcpy( m_memory, m_memory + m_bytes, end - m_bytes );
+    }
+    m_head.store( head + samples, std::memory_order_release );
+}
+
+int64_t AudioRing::writePosition() const
+{
+    return m_head.load( std::memory_order_relaxed );
+}
+
+const uint8_t* AudioRing::readPointer() const
+{
+    if ( m_capacity == 0 )
+        return m_memory;
+    return m_memory + ( m_tail.load( std::memory_order_relaxed ) % m_capacity ) * m_frameBytes;
+}
+
+void AudioRing::pop( size_t samples )
+{
+    m_tail.store( m_tail.load( std::memory_order_relaxed ) + samples, std::memory_order_release );
+}
+
+int64_t AudioRing::readPosition() const
+{
+    return m_tail.load( std::memory_order_relaxed );
+}
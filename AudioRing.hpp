@@ -0,0 +1,84 @@
+/*****************************************************************************
+ * AudioRing.hpp: Contiguous, sample indexed audio ring buffer
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef AUDIORING_HPP
+#define AUDIORING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Ring of interleaved audio samples for one writer and one reader. The memory
+// is mapped twice back to back, so any run of samples up to the capacity is
+// contiguous wherever it wraps: the writer can hand a pointer at the head to
+// a decoder, and the reader can take any span with a single copy. Where the
+// mirror can't be mapped, each write is copied to the second half instead.
+//
+// Positions count samples (frames of all channels) since the last reset().
+class AudioRing
+{
+public:
+    AudioRing();
+    ~AudioRing();
+
+    AudioRing( const AudioRing& ) = delete;
+    AudioRing& operator=( const AudioRing& ) = delete;
+
+    // Allocates room for at least `samples` samples of `frameBytes` bytes each
+    // and empties the ring. Neither side may be using it.
+    bool reset( size_t frameBytes, size_t samples );
+
+    size_t frameBytes() const;
+    size_t capacity() const;
+
+    // Usable from either side.
+    size_t size() const;
+
+    // Writer side
+
+    // Where the next `samples` samples go, or nullptr if they don't fit.
+    uint8_t* writePointer( size_t samples );
+    // Publishes `samples` samples written at writePointer().
+    void commit( size_t samples );
+    int64_t writePosition() const;
+
+    // Reader side
+
+    // The oldest sample, followed by size() - 1 more.
+    const uint8_t* readPointer() const;
+    void pop( size_t samples );
+    int64_t readPosition() const;
+
+private:
+    void release();
+
+    uint8_t*                m_memory;
+    size_t                  m_bytes;        // Of one half
+    size_t                  m_frameBytes;
+    size_t                  m_capacity;     // In samples
+    bool                    m_mirrored;
+
+    std::atomic<int64_t>    m_head;         // Written by the writer only
+    std::atomic<int64_t>    m_tail;         // Written by the reader only
+};
+
+#endif // AUDIORING_HPP
@@ -0,0 +1,103 @@
+/*****************************************************************************
+ * FrameCache.cpp: LRU cache of decoded images
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <tuple>
+#include <cstdlib>
+
+#include "common.hpp"
+#include "FrameCache.hpp"
+
+bool FrameCache::Key::operator<( const Key& other ) const
+{
+    return std::tie( time, format, width, height, source ) <
+           std::tie( other.time, other.format, other.width, other.height, other.source );
+}
+
+FrameCache::FrameCache( int64_t budget )
+    : m_budget( budget )
+    , m_bytes( 0 )
+{
+}
+
+FrameCache::~FrameCache()
+{
+    for ( auto& entry : m_entries )
+        FrameBuffer::release( entry.buffer );
+}
+
+FrameCache& FrameCache::global()
+{
+    // Never destroyed: by the time static objects go, mlt_factory_close()
+    // may have freed the pools the cached images live in.
+    static FrameCache* cache = new FrameCache( [] {
+        const char* budget = moduleSetting( "MLT_VLC_FRAME_CACHE" );
+        return budget != nullptr ? strtoll( budget, NULL, 10 ) : ( int64_t ) 256 * 1024 * 1024;
+    }() );
+    return *cache;
+}
+
+uint8_t* FrameCache::get( const Key& key, size_t* size )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    auto it = m_index.find( key );
+    if ( it == m_index.end() )
+        return nullptr;
+    m_entries.splice( m_entries.begin(), m_entries, it->second );
+    *size = it->second->size;
+    return FrameBuffer::ref( it->second->buffer );
+}
+
+void FrameCache::put( const Key& key, uint8_t* buffer, size_t size )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    if ( ( int64_t ) size > m_budget || m_index.count( key ) != 0 )
+        return;
+    m_entries.push_front( Entry{ key, FrameBuffer::ref( buffer ), size } );
+    m_index[key] = m_entries.begin();
+    m_bytes += size;
+    trim();
+}
+
+void FrameCache::setBudget( int64_t budget )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    m_budget = budget;
+    trim();
+}
+
+int64_t FrameCache::bytes()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return m_bytes;
+}
+
+void FrameCache::trim()
+{
+    while ( m_bytes > m_budget && m_entries.empty() == false )
+    {
+        Entry& entry = m_entries.back();
+        m_bytes -= entry.size;
+        FrameBuffer::release( entry.buffer );
+        m_index.erase( entry.key );
+        m_entries.pop_back();
+    }
+}
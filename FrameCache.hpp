@@ -0,0 +1,84 @@
+/*****************************************************************************
+ * FrameCache.hpp: LRU cache of decoded images
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef FRAMECACHE_HPP
+#define FRAMECACHE_HPP
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <framework/mlt.h>
+
+// Decoded images by what they show, least recently used first out once they
+// hold more than the budget. Images are FrameBuffers, so caching one and
+// handing it out only take references.
+class FrameCache
+{
+public:
+    struct Key
+    {
+        std::string     source;     // The resource and anything else changing its images
+        int64_t         time;       // Media time of the image
+        mlt_image_format format;
+        int             width;
+        int             height;
+
+        bool operator<( const Key& other ) const;
+    };
+
+    explicit FrameCache( int64_t budget );
+    ~FrameCache();
+
+    FrameCache( const FrameCache& ) = delete;
+    FrameCache& operator=( const FrameCache& ) = delete;
+
+    // The cache shared by all producers, holding MLT_VLC_FRAME_CACHE bytes
+    // (256 MiB by default).
+    static FrameCache& global();
+
+    // A new reference to the image, or nullptr.
+    uint8_t* get( const Key& key, size_t* size );
+    // Keeps a reference to `buffer`.
+    void put( const Key& key, uint8_t* buffer, size_t size );
+    void setBudget( int64_t budget );
+    int64_t bytes();
+
+private:
+    struct Entry
+    {
+        Key         key;
+        uint8_t*    buffer;
+        size_t      size;
+    };
+
+    void trim();
+
+    std::mutex              m_lock;
+    int64_t                 m_budget;
+    int64_t                 m_bytes;
+    std::list<Entry>        m_entries;      // Most recently used first
+    std::map<Key, std::list<Entry>::iterator>   m_index;
+};
+
+#endif // FRAMECACHE_HPP
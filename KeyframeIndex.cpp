@@ -0,0 +1,302 @@
+/*****************************************************************************
+ * KeyframeIndex.cpp: Keyframe index of a resource, cached on disk
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <sys/stat.h>
+
+#include "KeyframeIndex.hpp"
+
+#define FOURCC( a, b, c, d ) \
+    ( ( uint32_t )( a ) | ( ( uint32_t )( b ) << 8 ) | ( ( uint32_t )( c ) << 16 ) | ( ( uint32_t )( d ) << 24 ) )
+
+static const char* const IndexMagic = "vlc-keyframe-index 1";
+
+std::shared_ptr<KeyframeIndex> KeyframeIndex::get( const std::string& resource, uint32_t codec,
+                                                   VLC::Instance& instance )
+{
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<KeyframeIndex>> indexes;
+
+    if ( isSupported( codec ) == false )
+        return nullptr;
+
+    std::lock_guard<std::mutex> lck( lock );
+    auto index = indexes[resource].lock();
+    if ( index == nullptr )
+    {
+        index.reset( new KeyframeIndex( resource, codec, instance ) );
+        indexes[resource] = index;
+        if ( index->load() == false )
+            index->start();
+    }
+    return index;
+}
+
+KeyframeIndex::KeyframeIndex( const std::string& resource, uint32_t codec, VLC::Instance& instance )
+    : m_resource( resource )
+    , m_codec( codec )
+    , m_fileSize( -1 )
+    , m_fileMtime( -1 )
+    , m_instance( instance )
+    , m_endReached( nullptr )
+    , m_closing( false )
+    , m_origin( 0 )
+    , m_indexedUntil( -1 )
+{
+    struct stat st;
+    if ( stat( resource.c_str(), &st ) == 0 )
+    {
+        m_fileSize = st.st_size;
+        m_fileMtime = st.st_mtime;
+    }
+}
+
+KeyframeIndex::~KeyframeIndex()
+{
+    // The end of the pass runs on VLC's event thread. Wait for a save in
+    // progress and keep the next from starting.
+    {
+        std::lock_guard<std::mutex> lck( m_saveLock );
+        m_closing = true;
+    }
+    if ( m_endReached != nullptr )
+        m_endReached->unregister();
+    if ( m_mediaPlayer.isValid() == true )
+        m_mediaPlayer.stop();
+}
+
+int64_t KeyframeIndex::keyframeBefore( int64_t time )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+
+    if ( time > m_indexedUntil )
+        return -1;
+    auto it = std::upper_bound( m_keyframes.begin(), m_keyframes.end(), time );
+    if ( it == m_keyframes.begin() )
+        return -1;
+    return *( it - 1 );
+}
+
+void KeyframeIndex::start()
+{
+    // Demux only: without a transcode step smem receives the compressed blocks.
+    char smem_options[ 1000 ];
+    sprintf( smem_options,
+            ":sout=#smem{"
+            "video-prerender-callback=%" PRIdPTR ","
+            "video-postrender-callback=%" PRIdPTR ","
+            "video-data=%" PRIdPTR ","
+            "no-time-sync"
+            "}",
+            ( intptr_t ) &video_lock,
+            ( intptr_t ) &video_unlock,
+            ( intptr_t ) this
+    );
+
+    m_media = VLC::Media( m_instance, m_resource, VLC::Media::FromType::FromLocation );
+    m_media.addOption( smem_options );
+    m_media.addOption( ":no-sout-audio" );
+    m_media.addOption( ":no-sout-spu" );
+    m_mediaPlayer = VLC::MediaPlayer( m_media );
+    m_endReached = m_mediaPlayer.eventManager().onEndReached( [this]() {
+        std::lock_guard<std::mutex> saveLck( m_saveLock );
+        if ( m_closing == true )
+            return;
+        {
+            std::lock_guard<std::mutex> lck( m_lock );
+            m_indexedUntil = INT64_MAX;
+        }
+        save();
+    });
+    m_mediaPlayer.play();
+}
+
+std::string KeyframeIndex::cachePath()
+{
+    std::string dir;
+    if ( getenv( "XDG_CACHE_HOME" ) )
+        dir = getenv( "XDG_CACHE_HOME" );
+    else if ( getenv( "HOME" ) )
+        dir = std::string( getenv( "HOME" ) ) + "/.cache";
+    else
+        return std::string();
+    mkdir( dir.c_str(), 0755 );
+    dir += "/mlt-vlc";
+    mkdir( dir.c_str(), 0755 );
+
+    // FNV-1a over the key.
+    char key[64];
+    snprintf( key, sizeof( key ), "\n%" PRId64 "\n%" PRId64, m_fileSize, m_fileMtime );
+    uint64_t hash = 14695981039346656037ULL;
+    for ( char c : m_resource + key )
+    {
+        hash ^= ( uint8_t ) c;
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf( name, sizeof( name ), "/%016" PRIx64 ".idx", hash );
+    return dir + name;
+}
+
+bool KeyframeIndex::load()
+{
+    if ( m_fileSize < 0 )
+        return false;
+
+    FILE* file = fopen( cachePath().c_str(), "r" );
+    if ( file == nullptr )
+        return false;
+
+    // The header repeats the key, so a hash collision can't load a wrong index.
+    char line[4096];
+    int64_t size, mtime;
+    bool valid = fgets( line, sizeof( line ), file ) && strncmp( line, IndexMagic, strlen( IndexMagic ) ) == 0 &&
+            fgets( line, sizeof( line ), file ) && m_resource + "\n" == line &&
+            fscanf( file, "%" SCNd64 " %" SCNd64, &size, &mtime ) == 2 &&
+            size == m_fileSize && mtime == m_fileMtime;
+
+    std::vector<int64_t> keyframes;
+    int64_t time;
+    while ( valid == true && fscanf( file, "%" SCNd64, &time ) == 1 )
+        keyframes.push_back( time );
+    fclose( file );
+
+    if ( valid == false || keyframes.empty() == true )
+        return false;
+
+    std::lock_guard<std::mutex> lck( m_lock );
+    m_keyframes.swap( keyframes );
+    m_indexedUntil = INT64_MAX;
+    return true;
+}
+
+void KeyframeIndex::save()
+{
+    if ( m_fileSize < 0 )
+        return;
+
+    std::string path = cachePath();
+    if ( path.empty() == true )
+        return;
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen( temporary.c_str(), "w" );
+    if ( file == nullptr )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        fprintf( file, "%s\n%s\n%" PRId64 " %" PRId64 "\n", IndexMagic, m_resource.c_str(), m_fileSize, m_fileMtime );
+        for ( auto time : m_keyframes )
+            fprintf( file, "%" PRId64 "\n", time );
+    }
+
+    if ( fclose( file ) == 0 )
+        rename( temporary.c_str(), path.c_str() );
+    else
+        remove( temporary.c_str() );
+}
+
+bool KeyframeIndex::isSupported( uint32_t codec )
+{
+    switch ( codec )
+    {
+    case FOURCC( 'h', '2', '6', '4' ):
+    case FOURCC( 'h', 'e', 'v', 'c' ):
+    case FOURCC( 'm', 'p', 'g', 'v' ):
+    case FOURCC( 'M', 'J', 'P', 'G' ):
+    case FOURCC( 'j', 'p', 'e', 'g' ):
+    case FOURCC( 'a', 'p', 'c', 'n' ):
+    case FOURCC( 'a', 'p', 'c', 'h' ):
+    case FOURCC( 'a', 'p', 'c', 's' ):
+    case FOURCC( 'a', 'p', 'c', 'o' ):
+    case FOURCC( 'a', 'p', '4', 'h' ):
+    case FOURCC( 'A', 'V', 'd', 'n' ):
+    case FOURCC( 'd', 'v', 's', 'd' ):
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool KeyframeIndex::isKeyframe( const uint8_t* buffer, size_t size )
+{
+    switch ( m_codec )
+    {
+    case FOURCC( 'h', '2', '6', '4' ):
+    case FOURCC( 'h', 'e', 'v', 'c' ):
+    case FOURCC( 'm', 'p', 'g', 'v' ):
+        // VLC's packetizers output Annex B / start code delimited streams.
+        for ( size_t i = 0; i + 5 < size; i++ )
+        {
+            if ( buffer[i] != 0 || buffer[i + 1] != 0 || buffer[i + 2] != 1 )
+                continue;
+            const uint8_t* nal = buffer + i + 3;
+            if ( m_codec == FOURCC( 'h', '2', '6', '4' ) && ( nal[0] & 0x1f ) == 5 )
+                return true;
+            if ( m_codec == FOURCC( 'h', 'e', 'v', 'c' ) && ( ( nal[0] >> 1 ) & 0x3f ) >= 16 &&
+                 ( ( nal[0] >> 1 ) & 0x3f ) <= 21 )
+                return true;
+            if ( m_codec == FOURCC( 'm', 'p', 'g', 'v' ) && nal[0] == 0x00 )
+                return ( ( nal[2] >> 3 ) & 0x7 ) == 1;
+        }
+        return false;
+    default:
+        // Intra-only codecs
+        return true;
+    }
+}
+
+void KeyframeIndex::video_lock( void* data, uint8_t** buffer, size_t size )
+{
+    auto index = reinterpret_cast<KeyframeIndex*>( data );
+    if ( index->m_buffer.size() < size )
+        index->m_buffer.resize( size );
+    *buffer = index->m_buffer.data();
+}
+
+void KeyframeIndex::video_unlock( void* data, uint8_t* buffer, int width, int height,
+                                  int bpp, size_t size, int64_t pts )
+{
+    auto index = reinterpret_cast<KeyframeIndex*>( data );
+    if ( pts <= 0 )
+        return;
+
+    bool keyframe = index->isKeyframe( buffer, size );
+
+    std::lock_guard<std::mutex> lck( index->m_lock );
+    if ( index->m_origin == 0 )
+        index->m_origin = pts;
+    int64_t time = pts - index->m_origin;
+
+    // Keyframes arrive in presentation order, so the answer for any time up
+    // to the newest keyframe is final.
+    if ( keyframe == true )
+    {
+        index->m_keyframes.insert( std::upper_bound( index->m_keyframes.begin(), index->m_keyframes.end(), time ), time );
+        index->m_indexedUntil = std::max( index->m_indexedUntil, time );
+    }
+}
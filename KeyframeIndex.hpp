@@ -0,0 +1,87 @@
+/*****************************************************************************
+ * KeyframeIndex.hpp: Keyframe index of a resource, cached on disk
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef KEYFRAMEINDEX_HPP
+#define KEYFRAMEINDEX_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+
+#include <vlcpp/vlc.hpp>
+
+// Media times (in microseconds) of the keyframes of a resource's first video
+// stream. The index is built by a demux-only pass running in VLC's threads,
+// and saved to a cache file keyed by path, mtime and size so later opens of
+// the same file don't need the pass.
+class KeyframeIndex
+{
+public:
+    // Returns the shared index for `resource`, starting the pass if it isn't
+    // cached yet, or nullptr if keyframes of `codec` can't be detected. The
+    // pass runs on `instance`.
+    static std::shared_ptr<KeyframeIndex> get( const std::string& resource, uint32_t codec,
+                                               VLC::Instance& instance );
+
+    ~KeyframeIndex();
+
+    // Media time of the last keyframe at or before `time`, or -1 if it isn't
+    // indexed (yet).
+    int64_t keyframeBefore( int64_t time );
+
+private:
+    KeyframeIndex( const std::string& resource, uint32_t codec, VLC::Instance& instance );
+
+    void start();
+    bool load();
+    void save();
+    bool isKeyframe( const uint8_t* buffer, size_t size );
+    std::string cachePath();
+
+    static bool isSupported( uint32_t codec );
+
+    static void video_lock( void* data, uint8_t** buffer, size_t size );
+    static void video_unlock( void* data, uint8_t* buffer, int width, int height,
+                              int bpp, size_t size, int64_t pts );
+
+    std::string             m_resource;
+    uint32_t                m_codec;
+    int64_t                 m_fileSize;
+    int64_t                 m_fileMtime;
+
+    VLC::Instance&          m_instance;
+    VLC::Media              m_media;
+    VLC::MediaPlayer        m_mediaPlayer;
+    VLC::EventManager::RegisteredEvent  m_endReached;   // nullptr until start()
+    std::vector<uint8_t>    m_buffer;       // Only touched by VLC's video thread
+
+    std::mutex              m_saveLock;     // Held by the end of the pass while it saves
+    bool                    m_closing;      // Guarded by m_saveLock
+
+    std::mutex              m_lock;
+    std::vector<int64_t>    m_keyframes;    // Sorted media times
+    int64_t                 m_origin;       // smem timestamp of media time 0
+    int64_t                 m_indexedUntil; // Media time up to which the index is final
+};
+
+#endif // KEYFRAMEINDEX_HPP
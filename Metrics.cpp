@@ -0,0 +1,270 @@
+/*****************************************************************************
+ * Metrics.cpp: Counters and histograms for the hot paths
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+
+#include "common.hpp"
+#include "Metrics.hpp"
+
+namespace Metrics
+{
+
+namespace
+{
+
+// Live sets, and the thread dumping them.
+class Registry
+{
+public:
+    Registry()
+        : m_stopping( false )
+        , m_interval( 10 )
+    {
+        const char* path = moduleSetting( "MLT_VLC_METRICS_DUMP" );
+        if ( enabled() == false || path == nullptr )
+            return;
+        m_path = path;
+        const char* interval = moduleSetting( "MLT_VLC_METRICS_INTERVAL" );
+        if ( interval != nullptr && atoi( interval ) > 0 )
+            m_interval = atoi( interval );
+        m_thread = std::thread( &Registry::run, this );
+    }
+
+    ~Registry()
+    {
+        {
+            std::lock_guard<std::mutex> lck( m_lock );
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        if ( m_thread.joinable() == true )
+            m_thread.join();
+    }
+
+    void add( Set* set )
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_sets.insert( set );
+    }
+
+    void remove( Set* set )
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_sets.erase( set );
+    }
+
+    std::mutex& lock()
+    {
+        return m_lock;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lck( m_lock );
+        while ( m_cond.wait_for( lck, std::chrono::seconds( m_interval ),
+                                 [this]() { return m_stopping == true; } ) == false )
+        {
+            FILE* file = fopen( m_path.c_str(), "a" );
+            if ( file == nullptr )
+                continue;
+            const long now = time( NULL );
+            for ( auto set : m_sets )
+                fprintf( file, "{\"time\": %ld, \"pool_bytes\": %lld, %s}\n", now,
+                         ( long long ) FrameBuffer::bytes(), set->json().c_str() );
+            fclose( file );
+        }
+    }
+
+    std::mutex              m_lock;
+    std::condition_variable m_cond;
+    std::set<Set*>          m_sets;
+    bool                    m_stopping;
+    std::string             m_path;
+    int                     m_interval;     // Seconds
+    std::thread             m_thread;
+};
+
+Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+std::string escape( const std::string& text )
+{
+    std::string escaped;
+    for ( char c : text )
+    {
+        if ( c == '"' || c == '\\' )
+            escaped += '\\';
+        if ( ( unsigned char ) c >= 0x20 )
+            escaped += c;
+    }
+    return escaped;
+}
+
+}
+
+bool enabled()
+{
+    static const bool enabled = [] {
+        const char* value = moduleSetting( "MLT_VLC_METRICS" );
+        return value != nullptr && atoi( value ) != 0;
+    }();
+    return enabled;
+}
+
+Counter::Counter()
+    : m_value( 0 )
+{
+}
+
+int64_t Counter::value() const
+{
+    return m_value.load( std::memory_order_relaxed );
+}
+
+Histogram::Histogram()
+    : m_count( 0 )
+    , m_max( 0 )
+{
+    for ( auto& bucket : m_buckets )
+        bucket = 0;
+}
+
+void Histogram::record( int64_t duration )
+{
+    if ( enabled() == false )
+        return;
+    int bucket = 0;
+    while ( bucket < Buckets - 1 && ( ( int64_t ) 1 << bucket ) <= duration )
+        bucket++;
+    m_buckets[bucket].fetch_add( 1, std::memory_order_relaxed );
+    m_count.fetch_add( 1, std::memory_order_relaxed );
+    int64_t max = m_max.load( std::memory_order_relaxed );
+    while ( duration > max && m_max.compare_exchange_weak( max, duration, std::memory_order_relaxed ) == false )
+        ;
+}
+
+int64_t Histogram::count() const
+{
+    return m_count.load( std::memory_order_relaxed );
+}
+
+int64_t Histogram::percentile( double p ) const
+{
+    const int64_t rank = ( int64_t ) ( p * count() );
+    int64_t seen = 0;
+    for ( int bucket = 0; bucket < Buckets; bucket++ )
+    {
+        seen += m_buckets[bucket].load( std::memory_order_relaxed );
+        if ( seen > rank )
+            return std::min( ( int64_t ) 1 << bucket, max() );
+    }
+    return max();
+}
+
+int64_t Histogram::max() const
+{
+    return m_max.load( std::memory_order_relaxed );
+}
+
+Set::Set( const char* kind )
+    : m_kind( kind )
+{
+    registry().add( this );
+}
+
+Set::~Set()
+{
+    registry().remove( this );
+}
+
+void Set::add( const char* name, Counter& counter )
+{
+    // The dumping thread may already walk the set.
+    std::lock_guard<std::mutex> lck( registry().lock() );
+    m_counters.emplace_back( name, &counter );
+}
+
+void Set::add( const char* name, Histogram& histogram )
+{
+    // The dumping thread may already walk the set.
+    std::lock_guard<std::mutex> lck( registry().lock() );
+    m_histograms.emplace_back( name, &histogram );
+}
+
+void Set::setLabel( const std::string& label )
+{
+    std::lock_guard<std::mutex> lck( registry().lock() );
+    m_label = label;
+}
+
+void Set::publish( mlt_properties properties )
+{
+    if ( enabled() == false )
+        return;
+    std::string key;
+    for ( const auto& counter : m_counters )
+    {
+        key = "stats." + counter.first;
+        mlt_properties_set_int64( properties, key.c_str(), counter.second->value() );
+    }
+    for ( const auto& histogram : m_histograms )
+    {
+        key = "stats." + histogram.first;
+        mlt_properties_set_int64( properties, ( key + ".count" ).c_str(), histogram.second->count() );
+        mlt_properties_set_int64( properties, ( key + ".p50" ).c_str(), histogram.second->percentile( 0.5 ) );
+        mlt_properties_set_int64( properties, ( key + ".p99" ).c_str(), histogram.second->percentile( 0.99 ) );
+        mlt_properties_set_int64( properties, ( key + ".max" ).c_str(), histogram.second->max() );
+    }
+}
+
+// Called by the dumping thread, under the registry lock.
+std::string Set::json()
+{
+    char number[128];
+    std::string json = "\"kind\": \"" + m_kind + "\", \"label\": \"" + escape( m_label ) + "\"";
+    for ( const auto& counter : m_counters )
+    {
+        snprintf( number, sizeof( number ), "%lld", ( long long ) counter.second->value() );
+        json += ", \"" + counter.first + "\": " + number;
+    }
+    for ( const auto& histogram : m_histograms )
+    {
+        snprintf( number, sizeof( number ), "{\"count\": %lld, \"p50\": %lld, \"p99\": %lld, \"max\": %lld}",
+                  ( long long ) histogram.second->count(), ( long long ) histogram.second->percentile( 0.5 ),
+                  ( long long ) histogram.second->percentile( 0.99 ), ( long long ) histogram.second->max() );
+        json += ", \"" + histogram.first + "\": " + number;
+    }
+    return json;
+}
+
+}
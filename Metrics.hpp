@@ -0,0 +1,134 @@
+/*****************************************************************************
+ * Metrics.hpp: Counters and histograms for the hot paths
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <framework/mlt.h>
+
+// Instrumentation of the hot paths. It's always compiled in, but unless
+// MLT_VLC_METRICS=1 recording costs one relaxed load and a branch.
+//
+// Producers and consumers gather their counters and histograms in a
+// Metrics::Set, which publishes them as stats.* properties. With
+// MLT_VLC_METRICS_DUMP set to a file, every set is also appended to it as a
+// JSON line every MLT_VLC_METRICS_INTERVAL seconds (10 by default).
+namespace Metrics
+{
+
+bool enabled();
+
+class Counter
+{
+public:
+    Counter();
+
+    void add( int64_t count = 1 )
+    {
+        if ( enabled() == true )
+            m_value.fetch_add( count, std::memory_order_relaxed );
+    }
+    int64_t value() const;
+
+private:
+    std::atomic<int64_t>    m_value;
+};
+
+// Durations in microseconds, in power of two buckets. Percentiles are the
+// upper bound of their bucket, so they're within a factor of two.
+class Histogram
+{
+public:
+    Histogram();
+
+    void record( int64_t duration );
+    int64_t count() const;
+    int64_t percentile( double p ) const;
+    int64_t max() const;
+
+private:
+    static const int        Buckets = 32;
+
+    std::atomic<int64_t>    m_buckets[Buckets];
+    std::atomic<int64_t>    m_count;
+    std::atomic<int64_t>    m_max;
+};
+
+// Records the time until it goes out of scope.
+class Timer
+{
+public:
+    explicit Timer( Histogram& histogram )
+        : m_histogram( enabled() == true ? &histogram : nullptr )
+    {
+        if ( m_histogram != nullptr )
+            m_start = std::chrono::steady_clock::now();
+    }
+
+    ~Timer()
+    {
+        if ( m_histogram != nullptr )
+            m_histogram->record( std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - m_start ).count() );
+    }
+
+private:
+    Histogram*                              m_histogram;
+    std::chrono::steady_clock::time_point   m_start;
+};
+
+// The metrics of one producer or consumer, by name.
+class Set
+{
+public:
+    explicit Set( const char* kind );
+    ~Set();
+
+    Set( const Set& ) = delete;
+    Set& operator=( const Set& ) = delete;
+
+    void add( const char* name, Counter& counter );
+    void add( const char* name, Histogram& histogram );
+    // Names the set in dumps, e.g. with the resource.
+    void setLabel( const std::string& label );
+
+    // Sets stats.<name> for counters, and stats.<name>.count, .p50, .p99 and
+    // .max for histograms.
+    void publish( mlt_properties properties );
+    std::string json();
+
+private:
+    std::string     m_kind;
+    std::string     m_label;        // Only touched under the registry lock
+    std::vector<std::pair<std::string, Counter*>>   m_counters;
+    std::vector<std::pair<std::string, Histogram*>> m_histograms;
+};
+
+}
+
+#endif // METRICS_HPP
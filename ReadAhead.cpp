@@ -0,0 +1,128 @@
+/*****************************************************************************
+ * ReadAhead.cpp: Read-ahead depth control for the producer queues
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#include "ReadAhead.hpp"
+
+// std::min() binds it to a reference.
+const size_t ReadAhead::InitialDepth;
+
+ReadAhead::ReadAhead( size_t capacity )
+    : m_capacity( capacity )
+    , m_depth( std::min( InitialDepth, capacity ) )
+    , m_itemSize( 0 )
+    , m_decodeTime( 0 )
+    , m_decodeDeviation( 0 )
+    , m_discontinuity( true )
+    , m_lastDecoded( 0 )
+    , m_blocked( 0 )
+    , m_lastPull( 0 )
+    , m_pullInterval( 0 )
+    , m_itemsPerPull( 1 )
+    , m_boost( 0 )
+    , m_calmPulls( 0 )
+{
+}
+
+int64_t ReadAhead::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void ReadAhead::blocked( int64_t duration )
+{
+    m_blocked += duration;
+}
+
+void ReadAhead::decoded( size_t size )
+{
+    const int64_t time = now();
+    m_itemSize = size;
+
+    if ( m_discontinuity.exchange( false ) == false )
+    {
+        // Same smoothing as TCP's round trip estimate.
+        const int64_t sample = std::max<int64_t>( time - m_lastDecoded - m_blocked, 0 );
+        const int64_t mean = m_decodeTime;
+        m_decodeDeviation = m_decodeDeviation + ( std::llabs( sample - mean ) - m_decodeDeviation ) / 4;
+        m_decodeTime = mean + ( sample - mean ) / 8;
+    }
+    m_lastDecoded = time;
+    m_blocked = 0;
+}
+
+void ReadAhead::discontinuity()
+{
+    m_discontinuity = true;
+}
+
+void ReadAhead::pulled( double items, bool underrun, int64_t budget, int64_t otherBytes )
+{
+    const int64_t time = now();
+    const int64_t interval = time - m_lastPull;
+    m_lastPull = time;
+    // Longer gaps are pauses, not the pull rate.
+    if ( interval > 0 && interval < MaxPullInterval )
+        m_pullInterval = m_pullInterval == 0 ? interval : m_pullInterval + ( interval - m_pullInterval ) / 8;
+    m_itemsPerPull += ( items - m_itemsPerPull ) / 8;
+
+    if ( underrun == true )
+    {
+        m_boost = std::min( std::max<size_t>( m_boost * 2, 1 ), m_capacity );
+        m_calmPulls = 0;
+    }
+    else if ( ++m_calmPulls >= ShrinkAfter )
+    {
+        m_boost /= 2;
+        m_calmPulls = 0;
+    }
+
+    size_t depth = InitialDepth;
+    if ( m_pullInterval > 0 )
+    {
+        const double stall = m_decodeTime + 4 * m_decodeDeviation;
+        depth = ( size_t ) std::ceil( stall * m_itemsPerPull / m_pullInterval + m_itemsPerPull );
+    }
+    depth += m_boost;
+
+    const size_t itemSize = m_itemSize;
+    if ( budget > 0 && itemSize > 0 )
+        depth = std::min<size_t>( depth, std::max<int64_t>( budget - otherBytes, 0 ) / itemSize );
+    // Whatever the budget, one pull must fit or the consumer would never be served.
+    depth = std::max<size_t>( depth, ( size_t ) std::ceil( m_itemsPerPull ) );
+    m_depth = std::max<size_t>( std::min( depth, m_capacity ), 1 );
+}
+
+size_t ReadAhead::depth() const
+{
+    return m_depth;
+}
+
+int64_t ReadAhead::bytes( size_t items ) const
+{
+    return ( int64_t ) ( items * m_itemSize );
+}
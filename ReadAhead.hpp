@@ -0,0 +1,90 @@
+/*****************************************************************************
+ * ReadAhead.hpp: Read-ahead depth control for the producer queues
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef READAHEAD_HPP
+#define READAHEAD_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Decides how many items a decoder may queue ahead of the consumer.
+//
+// The decoder side reports every item it delivers and how long it was held
+// back waiting for room, which gives the decode time per item and its
+// deviation. The consumer side reports every pull, which gives the pull
+// interval. The depth is what covers a decode stall of mean + 4 deviations at
+// the current pull rate, plus a boost that doubles on every underrun and
+// halves again after a calm stretch, capped by the queue capacity and a
+// memory budget.
+class ReadAhead
+{
+public:
+    explicit ReadAhead( size_t capacity );
+
+    // Decoder side
+
+    // The decoder waited `duration` microseconds for room.
+    void blocked( int64_t duration );
+    // The decoder delivered an item of `size` bytes.
+    void decoded( size_t size );
+    // The next item doesn't follow the previous one, e.g. after a seek.
+    void discontinuity();
+
+    // Consumer side
+
+    // A pull took `items` items, and had to wait for them if `underrun`.
+    // `budget` is the memory the producer may buffer, `otherBytes` what its
+    // other queue holds of it. Updates depth().
+    void pulled( double items, bool underrun, int64_t budget, int64_t otherBytes );
+
+    // Usable from either side.
+    size_t depth() const;
+    int64_t bytes( size_t items ) const;
+
+    static int64_t now();
+
+private:
+    size_t                  m_capacity;
+    std::atomic<size_t>     m_depth;
+    std::atomic<size_t>     m_itemSize;
+
+    // Decoder side, in microseconds
+    std::atomic<int64_t>    m_decodeTime;
+    std::atomic<int64_t>    m_decodeDeviation;
+    std::atomic_bool        m_discontinuity;
+    int64_t                 m_lastDecoded;
+    int64_t                 m_blocked;
+
+    // Consumer side
+    int64_t                 m_lastPull;
+    int64_t                 m_pullInterval;     // 0 until measured
+    double                  m_itemsPerPull;
+    size_t                  m_boost;
+    int                     m_calmPulls;        // Pulls since the last underrun
+
+    static const size_t     InitialDepth = 5;
+    static const int        ShrinkAfter = 50;
+    static const int64_t    MaxPullInterval = 1000000;
+};
+
+#endif // READAHEAD_HPP
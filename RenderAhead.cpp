@@ -0,0 +1,338 @@
+/*****************************************************************************
+ * RenderAhead.cpp: Renders consumer frames ahead on worker threads
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <cstdlib>
+#include <algorithm>
+
+#include "RenderAhead.hpp"
+
+RenderAhead::RenderAhead( mlt_consumer consumer )
+    : m_consumer( consumer )
+    , m_format( mlt_image_yuv420p )
+    , m_depth( 1 )
+    , m_maxBytes( 0 )
+    , m_dropAfter( 0 )
+    , m_bytes( 0 )
+    , m_generation( 0 )
+    , m_frameCount( 0 )
+    , m_fpsNum( 25 )
+    , m_fpsDen( 1 )
+    , m_lastVideoPts( 0 )
+    , m_lastAudioPts( 0 )
+    , m_maxSkew( 0 )
+    , m_videoDropped( 0 )
+    , m_audioDropped( 0 )
+    , m_stopping( true )
+{
+}
+
+RenderAhead::~RenderAhead()
+{
+    stop();
+}
+
+void RenderAhead::start( size_t threads, size_t depth, int64_t maxBytes, int dropAfter, mlt_image_format format )
+{
+    stop();
+
+    m_format = format;
+    m_depth = depth > 0 ? depth : 1;
+    m_maxBytes = maxBytes;
+    m_dropAfter = std::chrono::milliseconds( dropAfter );
+    m_fpsNum = mlt_properties_get_int( MLT_CONSUMER_PROPERTIES( m_consumer ), "frame_rate_num" );
+    m_fpsDen = mlt_properties_get_int( MLT_CONSUMER_PROPERTIES( m_consumer ), "frame_rate_den" );
+    if ( m_fpsNum <= 0 || m_fpsDen <= 0 )
+    {
+        m_fpsNum = 25;
+        m_fpsDen = 1;
+    }
+    m_stopping = false;
+    for ( size_t i = 0; i < ( threads > 0 ? threads : 1 ); i++ )
+        m_threads.emplace_back( &RenderAhead::run, this );
+}
+
+void RenderAhead::stop()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_stopping = true;
+    }
+    m_readyCond.notify_all();
+    m_roomCond.notify_all();
+    for ( auto& thread : m_threads )
+        thread.join();
+    m_threads.clear();
+    purge();
+}
+
+void RenderAhead::purge()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_frames.clear();
+        m_bytes = 0;
+        m_generation++;
+    }
+    m_roomCond.notify_all();
+}
+
+void RenderAhead::resetClock()
+{
+    std::lock_guard<std::mutex> fetchLck( m_fetchLock );
+    m_frameCount = 0;
+
+    std::lock_guard<std::mutex> lck( m_lock );
+    m_lastVideoPts = 0;
+    m_lastAudioPts = 0;
+    m_maxSkew = 0;
+}
+
+void RenderAhead::run()
+{
+    mlt_properties properties = MLT_CONSUMER_PROPERTIES( m_consumer );
+
+    for ( ;; )
+    {
+        auto rendered = std::make_shared<Rendered>();
+        {
+            std::lock_guard<std::mutex> fetchLck( m_fetchLock );
+            {
+                std::unique_lock<std::mutex> lck( m_lock );
+                m_roomCond.wait( lck, [this]() { return m_stopping == true || full() == false; } );
+                if ( m_stopping == true )
+                    return;
+                rendered->generation = m_generation;
+                m_frames.push_back( rendered );
+            }
+
+            mlt_frame frame = mlt_consumer_get_frame( m_consumer );
+            if ( frame != nullptr )
+            {
+                rendered->frame = std::make_shared<Mlt::Frame>( frame );
+                rendered->frame->dec_ref();
+
+                // Stamp both tracks in graph order, so a dropped frame leaves a
+                // gap in its track instead of shifting it. Frame n starts at
+                // n * den / num seconds, its audio at the first sample at or
+                // after that time.
+                const int frequency = mlt_properties_get_int( properties, "frequency" );
+                const int64_t n = m_frameCount++;
+                const int64_t samples = samplesBefore( n, frequency );
+                rendered->samples = samplesBefore( n + 1, frequency ) - samples;
+                rendered->videoPts = PtsOrigin + n * 1000000 * m_fpsDen / m_fpsNum;
+                rendered->audioPts = PtsOrigin + ( frequency > 0 ? samples * 1000000 / frequency : 0 );
+            }
+        }
+
+        // Frames are rendered in parallel, but handed out in order.
+        if ( rendered->frame != nullptr )
+        {
+            Metrics::Timer timer( m_renderTime );
+            render( *rendered );
+        }
+
+        {
+            std::lock_guard<std::mutex> lck( m_lock );
+            rendered->ready = true;
+            if ( rendered->generation == m_generation )
+                m_bytes += rendered->imageSize + rendered->audioSize;
+        }
+        m_readyCond.notify_all();
+    }
+}
+
+void RenderAhead::render( Rendered& rendered )
+{
+    Mlt::Frame& frame = *rendered.frame;
+    mlt_properties properties = MLT_CONSUMER_PROPERTIES( m_consumer );
+
+    mlt_image_format format = m_format;
+    int width = frame.get_int( "width" );
+    int height = frame.get_int( "height" );
+    rendered.image = frame.get_image( format, width, height, 0 );
+    rendered.imageSize = mlt_image_format_size( format, width, height, NULL );
+
+    mlt_audio_format audioFormat = mlt_audio_s16;
+    int frequency = mlt_properties_get_int( properties, "frequency" );
+    int channels = mlt_properties_get_int( properties, "channels" );
+    int samples = rendered.samples;
+    rendered.audio = frame.get_audio( audioFormat, frequency, channels, samples );
+    rendered.audioSize = mlt_audio_format_size( audioFormat, samples, channels );
+    rendered.samples = samples;
+}
+
+int64_t RenderAhead::samplesBefore( int64_t frame, int frequency )
+{
+    return ( frame * frequency * m_fpsDen + m_fpsNum - 1 ) / m_fpsNum;
+}
+
+bool RenderAhead::full()
+{
+    return m_frames.size() >= m_depth || ( m_maxBytes > 0 && m_bytes >= m_maxBytes );
+}
+
+void RenderAhead::popFront()
+{
+    auto& front = m_frames.front();
+    if ( front->ready == true )
+        m_bytes -= front->imageSize + front->audioSize;
+    m_frames.pop_front();
+    m_roomCond.notify_one();
+}
+
+std::shared_ptr<RenderAhead::Rendered> RenderAhead::takeVideo()
+{
+    return take( &Rendered::videoTaken, &Rendered::audioTaken, m_audioDropped );
+}
+
+std::shared_ptr<RenderAhead::Rendered> RenderAhead::takeAudio()
+{
+    return take( &Rendered::audioTaken, &Rendered::videoTaken, m_videoDropped );
+}
+
+std::shared_ptr<RenderAhead::Rendered> RenderAhead::take( bool Rendered::*taken, bool Rendered::*otherTaken,
+                                                           int& otherDropped )
+{
+    std::unique_lock<std::mutex> lck( m_lock );
+    std::shared_ptr<Rendered> next;
+    bool stalled = false;
+    std::chrono::steady_clock::time_point deadline;
+
+    for ( ;; )
+    {
+        if ( m_stopping == true )
+            return nullptr;
+
+        next = nullptr;
+        for ( auto& rendered : m_frames )
+        {
+            if ( rendered.get()->*taken == false )
+            {
+                next = rendered;
+                break;
+            }
+        }
+        if ( next != nullptr && next->ready == true )
+            break;
+
+        // The window is full of frames we already took: the other track has
+        // stalled. Give it some time, then drop its oldest frame.
+        if ( full() == true && m_frames.front().get()->*taken == true && m_dropAfter.count() >= 0 )
+        {
+            if ( stalled == false )
+            {
+                stalled = true;
+                deadline = std::chrono::steady_clock::now() + m_dropAfter;
+            }
+            else if ( std::chrono::steady_clock::now() >= deadline )
+            {
+                popFront();
+                otherDropped++;
+                stalled = false;
+                continue;
+            }
+            m_readyCond.wait_until( lck, deadline );
+        }
+        else
+        {
+            stalled = false;
+            m_readyCond.wait( lck );
+        }
+    }
+
+    next.get()->*taken = true;
+    if ( taken == &Rendered::videoTaken )
+        m_lastVideoPts = next->videoPts;
+    else
+        m_lastAudioPts = next->audioPts;
+    // Only meaningful once both tracks have taken something.
+    if ( m_lastVideoPts > 0 && m_lastAudioPts > 0 )
+        m_maxSkew = std::max( m_maxSkew, std::abs( m_lastAudioPts - m_lastVideoPts ) );
+    bool popped = false;
+    while ( m_frames.empty() == false && m_frames.front().get()->*taken == true &&
+            m_frames.front().get()->*otherTaken == true )
+    {
+        popFront();
+        popped = true;
+    }
+    // The other track may be waiting for the window to move.
+    if ( popped == true )
+        m_readyCond.notify_all();
+    return next;
+}
+
+size_t RenderAhead::queued( bool Rendered::*taken )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    size_t count = 0;
+    for ( auto& rendered : m_frames )
+        if ( rendered.get()->*taken == false )
+            count++;
+    return count;
+}
+
+size_t RenderAhead::videoQueued()
+{
+    return queued( &Rendered::videoTaken );
+}
+
+size_t RenderAhead::audioQueued()
+{
+    return queued( &Rendered::audioTaken );
+}
+
+int64_t RenderAhead::bytes()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return m_bytes;
+}
+
+int RenderAhead::videoDropped()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return m_videoDropped;
+}
+
+int RenderAhead::audioDropped()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return m_audioDropped;
+}
+
+int64_t RenderAhead::avSkew()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    if ( m_lastVideoPts == 0 || m_lastAudioPts == 0 )
+        return 0;
+    return m_lastAudioPts - m_lastVideoPts;
+}
+
+int64_t RenderAhead::avSkewMax()
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    return m_maxSkew;
+}
+
+Metrics::Histogram& RenderAhead::renderTime()
+{
+    return m_renderTime;
+}
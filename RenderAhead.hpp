@@ -0,0 +1,149 @@
+/*****************************************************************************
+ * RenderAhead.hpp: Renders consumer frames ahead on worker threads
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef RENDERAHEAD_HPP
+#define RENDERAHEAD_HPP
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include <mlt++/MltConsumer.h>
+
+#include "Metrics.hpp"
+
+// Pulls frames from a consumer's graph in order and renders their image and
+// audio on a few worker threads. Both tracks share one window of frames
+// ordered by pts; a frame leaves it once its image and audio were taken.
+// More than one worker renders neighbouring frames concurrently, which only
+// suits producers that don't mind being asked out of order.
+//
+// The workers stop when the window holds `depth` frames or `maxBytes` of
+// rendered data. If one track stops taking while the other one waits for the
+// window to move, the stalled track's oldest frame is dropped after
+// `dropAfter` milliseconds, or never if it's negative.
+//
+// Pts are derived from the frame's index on the output timeline with integer
+// arithmetic on the profile's frame rate, for video as for audio, so they
+// don't drift however long the consumer runs.
+class RenderAhead
+{
+public:
+    struct Rendered {
+        Rendered()
+            : image( nullptr )
+            , imageSize( 0 )
+            , audio( nullptr )
+            , audioSize( 0 )
+            , samples( 0 )
+            , videoPts( 0 )
+            , audioPts( 0 )
+            , generation( 0 )
+            , ready( false )
+            , videoTaken( false )
+            , audioTaken( false )
+        {
+        }
+
+        std::shared_ptr<Mlt::Frame> frame;
+        uint8_t*    image;
+        size_t      imageSize;
+        void*       audio;
+        size_t      audioSize;
+        int         samples;
+        int64_t     videoPts;
+        int64_t     audioPts;
+        uint32_t    generation;
+        bool        ready;
+        bool        videoTaken;
+        bool        audioTaken;
+    };
+
+    explicit RenderAhead( mlt_consumer consumer );
+    ~RenderAhead();
+
+    void start( size_t threads, size_t depth, int64_t maxBytes, int dropAfter, mlt_image_format format );
+    void stop();
+    // Drops what was rendered, e.g. after a seek.
+    void purge();
+    // Restarts the output timeline, and with it the pts of both tracks.
+    void resetClock();
+
+    // Block until the next frame is rendered. nullptr once stopped.
+    std::shared_ptr<Rendered> takeVideo();
+    std::shared_ptr<Rendered> takeAudio();
+
+    // Frames in the window not taken by the track yet.
+    size_t videoQueued();
+    size_t audioQueued();
+    int64_t bytes();
+    int videoDropped();
+    int audioDropped();
+    // Audio pts minus video pts of the frames taken last, in microseconds,
+    // and the largest skew seen since resetClock().
+    int64_t avSkew();
+    int64_t avSkewMax();
+    // Time spent rendering each frame, in microseconds.
+    Metrics::Histogram& renderTime();
+
+private:
+    void run();
+    void render( Rendered& rendered );
+    std::shared_ptr<Rendered> take( bool Rendered::*taken, bool Rendered::*otherTaken, int& otherDropped );
+    size_t queued( bool Rendered::*taken );
+    bool full();
+    void popFront();
+    int64_t samplesBefore( int64_t frame, int frequency );
+
+    mlt_consumer            m_consumer;
+    mlt_image_format        m_format;
+    size_t                  m_depth;
+    int64_t                 m_maxBytes;     // 0 for no limit
+    std::chrono::milliseconds   m_dropAfter;    // Negative to never drop
+
+    std::mutex              m_fetchLock;    // Keeps frames in graph order
+    std::mutex              m_lock;
+    std::condition_variable m_readyCond;
+    std::condition_variable m_roomCond;
+    std::deque<std::shared_ptr<Rendered>>   m_frames;
+    int64_t                 m_bytes;        // Rendered data in m_frames
+    uint32_t                m_generation;   // Bumped by purge()
+    int64_t                 m_frameCount;   // Frames fetched since resetClock(), under m_fetchLock
+    int                     m_fpsNum;
+    int                     m_fpsDen;
+    int64_t                 m_lastVideoPts;
+    int64_t                 m_lastAudioPts;
+    int64_t                 m_maxSkew;
+    int                     m_videoDropped;
+    int                     m_audioDropped;
+    bool                    m_stopping;
+    std::vector<std::thread>    m_threads;
+    Metrics::Histogram      m_renderTime;
+
+    static const int64_t    PtsOrigin = 1;  // VLC treats 0 as no timestamp
+};
+
+#endif // RENDERAHEAD_HPP
@@ -0,0 +1,199 @@
+/*****************************************************************************
+ * SPSCQueue.hpp: Lock-free single producer/single consumer queue
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef SPSCQUEUE_HPP
+#define SPSCQUEUE_HPP
+
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cerrno>
+
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// A counter that can be waited on for a change. wake() only costs a syscall
+// when somebody is actually waiting.
+class Futex
+{
+public:
+    Futex()
+        : m_value( 0 )
+        , m_waiters( 0 )
+    {
+    }
+
+    uint32_t value() const
+    {
+        return m_value.load( std::memory_order_acquire );
+    }
+
+    // Waits until value() differs from `expected`. Returns false on timeout.
+    bool wait( uint32_t expected, std::chrono::milliseconds timeout )
+    {
+        m_waiters++;
+#ifdef __linux__
+        struct timespec ts;
+        ts.tv_sec = timeout.count() / 1000;
+        ts.tv_nsec = ( timeout.count() % 1000 ) * 1000000;
+        bool timedOut = syscall( SYS_futex, reinterpret_cast<uint32_t*>( &m_value ), FUTEX_WAIT_PRIVATE,
+                                 expected, &ts, NULL, 0 ) != 0 && errno == ETIMEDOUT;
+#else
+        std::unique_lock<std::mutex> lck( m_lock );
+        bool timedOut = m_cond.wait_for( lck, timeout, [this, expected]{ return value() != expected; } ) == false;
+#endif
+        m_waiters--;
+        return timedOut == false;
+    }
+
+    void wake()
+    {
+        m_value++;
+        if ( m_waiters.load() == 0 )
+            return;
+#ifdef __linux__
+        syscall( SYS_futex, reinterpret_cast<uint32_t*>( &m_value ), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+#else
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_cond.notify_all();
+#endif
+    }
+
+private:
+    std::atomic<uint32_t>   m_value;
+    std::atomic_int         m_waiters;
+#ifndef __linux__
+    std::mutex              m_lock;
+    std::condition_variable m_cond;
+#endif
+};
+
+// Fixed capacity ring of preallocated slots. One thread fills slots at the back
+// with next()/push(), another reads and pops them at the front; neither locks.
+// T must provide reset(), which pop() calls before a slot is reused.
+template <typename T>
+class SPSCQueue
+{
+public:
+    explicit SPSCQueue( size_t capacity )
+        : m_slots( capacity )
+        , m_head( 0 )
+        , m_tail( 0 )
+    {
+    }
+
+    size_t capacity() const
+    {
+        return m_slots.size();
+    }
+
+    // Usable from either side.
+    size_t size() const
+    {
+        return m_head.load( std::memory_order_acquire ) - m_tail.load( std::memory_order_acquire );
+    }
+
+    // Producer side
+
+    bool full() const
+    {
+        return m_head.load( std::memory_order_relaxed ) - m_tail.load( std::memory_order_acquire ) >= m_slots.size();
+    }
+
+    // The slot push() publishes. Only valid while the queue isn't full.
+    T& next()
+    {
+        return m_slots[m_head.load( std::memory_order_relaxed ) % m_slots.size()];
+    }
+
+    void push()
+    {
+        m_head.store( m_head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+        m_produced.wake();
+    }
+
+    // Consumer side
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    T& operator[]( size_t index )
+    {
+        return m_slots[( m_tail.load( std::memory_order_relaxed ) + index ) % m_slots.size()];
+    }
+
+    T& front()
+    {
+        return ( *this )[0];
+    }
+
+    T& back()
+    {
+        return ( *this )[size() - 1];
+    }
+
+    void pop( size_t count = 1 )
+    {
+        size_t tail = m_tail.load( std::memory_order_relaxed );
+        for ( size_t i = 0; i < count; i++ )
+            m_slots[( tail + i ) % m_slots.size()].reset();
+        m_tail.store( tail + count, std::memory_order_release );
+        m_consumed.wake();
+    }
+
+    void clear()
+    {
+        pop( size() );
+    }
+
+    // Changes whenever a slot is pushed, for the consumer to wait on.
+    Futex& produced()
+    {
+        return m_produced;
+    }
+
+    // Changes whenever slots are popped, for the producer to wait on.
+    Futex& consumed()
+    {
+        return m_consumed;
+    }
+
+private:
+    std::vector<T>      m_slots;
+    std::atomic<size_t> m_head;     // Written by the producer only
+    std::atomic<size_t> m_tail;     // Written by the consumer only
+    Futex               m_produced;
+    Futex               m_consumed;
+};
+
+#endif // SPSCQUEUE_HPP
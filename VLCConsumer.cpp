@@ -24,8 +24,8 @@
 
 
 #include <string>
-#include <deque>
 #include <vector>
+#include <deque>
 #include <sys/time.h>
 #include <memory>
 #include <mutex>
@@ -35,6 +35,8 @@
 #include <vlcpp/vlc.hpp>
 
 #include "common.hpp"
+#include "RenderAhead.hpp"
+#include "Metrics.hpp"
 
 class VLCConsumer
 {
@@ -51,8 +53,9 @@ public:
     }
 
     VLCConsumer( mlt_profile profile )
-        : m_lastAudioPts( 0 )
-        , m_lastVideoPts( 0 )
+        : m_instance( vlcInstance() )
+        , m_imageFormat( mlt_image_yuv420p )
+        , m_metrics( "consumer" )
     {
         mlt_consumer parent = new mlt_consumer_s;
         mlt_consumer_init( parent, this, profile );
@@ -61,9 +64,20 @@ public:
         m_parent->dec_ref();
         auto mlt_parent = m_parent->get_consumer();
 
-        m_parent->set( "input_image_format", mlt_image_yuv422 );
+        m_parent->set( "mlt_image_format", "yuv420p" );
         m_parent->set( "input_audio_format", mlt_audio_s16 );
         m_parent->set( "buffer", 1 );
+        m_parent->set( "render_threads", 1 );
+        m_parent->set( "render_ahead", 4 );
+        m_parent->set( "render_ahead_bytes", ( int64_t ) 256 * 1024 * 1024 );
+        m_parent->set( "render_drop_after", 200 );
+        m_parent->set( "vcodec", "h264" );
+        m_parent->set( "acodec", "mp4a" );
+
+        m_renderAhead.reset( new RenderAhead( mlt_parent ) );
+        m_metrics.add( "render_us", m_renderAhead->renderTime() );
+        m_metrics.add( "imem_video_us", m_imemVideo );
+        m_metrics.add( "imem_audio_us", m_imemAudio );
 
         mlt_parent->start = consumer_start;
         mlt_parent->stop = consumer_stop;
@@ -74,8 +88,29 @@ public:
         resetMedia();
     }
 
+    // Maps the mlt_image_format property to the MLT format and the imem codec.
+    // I420 is what most sources decode to, so it's passed through unconverted.
+    static mlt_image_format imageFormat( const char* name, const char** codec )
+    {
+        if ( name != nullptr && strcmp( name, "yuv422" ) == 0 )
+        {
+            *codec = "YUY2";
+            return mlt_image_yuv422;
+        }
+        else if ( name != nullptr && strcmp( name, "rgb24a" ) == 0 )
+        {
+            *codec = "RGBA";
+            return mlt_image_rgb24a;
+        }
+        *codec = "I420";
+        return mlt_image_yuv420p;
+    }
+
     void resetMedia()
     {
+        const char* codec;
+        m_imageFormat = imageFormat( m_parent->get( "mlt_image_format" ), &codec );
+
         char videoString[512];
         char inputSlave[256];
         char audioParameters[256];
@@ -86,13 +121,13 @@ public:
                  m_parent->get_int( "sample_aspect_den" ),
                  m_parent->get_int( "frame_rate_num" ),
                  m_parent->get_int( "frame_rate_den" ),
-                 "YUY2" );
+                 codec );
         sprintf( audioParameters, "cookie=1:cat=1:codec=s16l:samplerate=%u:channels=%u:caching=0",
                  m_parent->get_int( "frequency" ),
                  m_parent->get_int( "channels" ) );
         strcpy( inputSlave, ":input-slave=imem://" );
         strcat( inputSlave, audioParameters );
-        m_media = VLC::Media( instance, std::string( "imem://" ) + videoString,
+        m_media = VLC::Media( m_instance, std::string( "imem://" ) + videoString,
                               VLC::Media::FromType::FromLocation );
         m_media.addOption( inputSlave );
 
@@ -104,9 +139,72 @@ public:
         sprintf( buffer, ":imem-data=%p", this );
         m_media.addOption( buffer );
 
+        const std::string sout = streamOutput();
+        if ( sout.empty() == false )
+            m_media.addOption( ":sout=" + sout );
+
         m_mediaPlayer = VLC::MediaPlayer( m_media );
     }
 
+    // The stream output chain: `sout` as is, or one transcoding to `target`.
+    // Empty to play in `window_id`.
+    std::string streamOutput()
+    {
+        const char* sout = m_parent->get( "sout" );
+        if ( sout != nullptr && sout[0] != '\0' )
+            return sout;
+        const char* target = m_parent->get( "target" );
+        if ( target == nullptr || target[0] == '\0' )
+            return std::string();
+
+        // The codecs, like the mux and the target, are free form.
+        std::string chain = "#transcode{";
+        const char* vcodec = m_parent->get( "vcodec" );
+        if ( vcodec != nullptr && vcodec[0] != '\0' )
+            chain += "vcodec=" + std::string( vcodec ) + ",";
+        const char* acodec = m_parent->get( "acodec" );
+        if ( acodec != nullptr && acodec[0] != '\0' )
+            chain += "acodec=" + std::string( acodec ) + ",";
+        chain += "channels=" + std::to_string( m_parent->get_int( "channels" ) );
+        chain += ",samplerate=" + std::to_string( m_parent->get_int( "frequency" ) );
+        if ( m_parent->get_int( "vb" ) > 0 )
+            chain += ",vb=" + std::to_string( m_parent->get_int( "vb" ) );
+        if ( m_parent->get_int( "ab" ) > 0 )
+            chain += ",ab=" + std::to_string( m_parent->get_int( "ab" ) );
+        chain += "}";
+
+        const char* mux = m_parent->get( "mux" );
+        if ( strncmp( target, "udp://", 6 ) == 0 )
+        {
+            chain += ":std{access=udp,mux=";
+            chain += mux != nullptr ? mux : "ts";
+            chain += ",dst=" + std::string( target + 6 ) + "}";
+        }
+        else if ( strncmp( target, "rtp://", 6 ) == 0 )
+        {
+            std::string destination = target + 6;
+            std::string port;
+            auto colon = destination.rfind( ':' );
+            if ( colon != std::string::npos )
+            {
+                port = ",port=" + destination.substr( colon + 1 );
+                destination.erase( colon );
+            }
+            chain += ":rtp{dst=" + destination + port + ",mux=";
+            chain += mux != nullptr ? mux : "ts";
+            chain += "}";
+        }
+        else
+        {
+            // Without a mux, VLC picks one from the file extension.
+            chain += ":std{access=file,";
+            if ( mux != nullptr )
+                chain += "mux=" + std::string( mux ) + ",";
+            chain += "dst=\"" + std::string( target ) + "\"}";
+        }
+        return chain;
+    }
+
     mlt_consumer consumer()
     {
         return m_parent->get_consumer();
@@ -119,12 +217,24 @@ public:
 
     bool start()
     {
-        setXWindow( m_parent->get_int64( "window_id" ) );
+        // The output options are baked into the media, so pick up changes.
+        resetMedia();
+        if ( streamOutput().empty() == true )
+            setXWindow( m_parent->get_int64( "window_id" ) );
+        // Without a clock to keep up with, nothing is worth dropping: VLC
+        // takes frames as fast as the graph renders them.
+        const bool realTime = m_parent->get_int( "real_time" ) != 0;
+        m_renderAhead->start( m_parent->get_int( "render_threads" ), m_parent->get_int( "render_ahead" ),
+                              m_parent->get_int64( "render_ahead_bytes" ),
+                              realTime == true ? m_parent->get_int( "render_drop_after" ) : -1,
+                              m_imageFormat );
         return m_mediaPlayer.play();
     }
 
     bool stop()
     {
+        // Wakes imem_get, which may be waiting for a frame.
+        m_renderAhead->stop();
         m_mediaPlayer.stop();
         clean();
         return true;
@@ -142,131 +252,126 @@ public:
 
     void purge()
     {
-        m_audioFrames.clear();
-        m_videoFrames.clear();
+        m_renderAhead->purge();
     }
 
     void clean()
     {
-        m_lastAudioPts = 0;
-        m_lastVideoPts = 0;
+        m_renderAhead->resetClock();
         purge();
+        {
+            // The player is stopped, so VLC won't give anything back anymore.
+            std::lock_guard<std::mutex> lck( m_safeLock );
+            m_lentVideo.clear();
+            m_lentAudio.clear();
+        }
         resetMedia();
     }
 
-    ~VLCConsumer() = default;
+    ~VLCConsumer()
+    {
+        m_renderAhead->stop();
+    }
 
     static const uint8_t     VideoCookie = '0';
     static const uint8_t     AudioCookie = '1';
 
 private:
 
+    // Only hands out what the render-ahead workers finished, so the effect
+    // graph never runs on VLC's input thread.
     static int imem_get( void* data, const char* cookie, int64_t* dts, int64_t* pts,
                         unsigned* flags, size_t* bufferSize, void** buffer )
     {
         auto vlcConsumer = reinterpret_cast<VLCConsumer*>( data );
-        std::unique_lock<std::mutex> lck( vlcConsumer->m_safeLock );
 
         if ( cookie[0] == VLCConsumer::AudioCookie )
         {
-            std::shared_ptr<Mlt::Frame> frame;
-
-            bool cleanup;
-            if ( ( cleanup = vlcConsumer->m_audioFrames.size() > 0 ) )
-            {
-                frame = vlcConsumer->m_audioFrames.front();
-                vlcConsumer->m_audioFrames.pop_front();
-            }
-            else
-            {
-                frame = std::make_shared<Mlt::Frame>( mlt_consumer_rt_frame( vlcConsumer->m_parent->get_consumer() ) );
-                frame->dec_ref();
-            }
-
-            mlt_audio_format audioFormat = mlt_audio_s16;
-            int frequency = frame->get_int( "audio_frequency" );
-            int channels = frame->get_int( "audio_channels" );
-            int samples = mlt_sample_calculator(
-                vlcConsumer->m_parent->get_double( "fps" ),
-                frequency,
-                mlt_frame_original_position( frame->get_frame() )
-            );
-
-            *buffer = frame->get_audio( audioFormat, frequency, channels, samples );
-            *bufferSize = mlt_audio_format_size( audioFormat, samples, channels );
-            double ptsDiff = ( double ) samples / frequency * 1000000.0 + 0.5;
-
-
-            *pts = vlcConsumer->m_lastAudioPts + ptsDiff;
-            mlt_log_debug( vlcConsumer->consumer(), "%ld", *pts );
-            vlcConsumer->m_lastAudioPts = *pts;
+            Metrics::Timer timer( vlcConsumer->m_imemAudio );
+            auto rendered = vlcConsumer->m_renderAhead->takeAudio();
+            if ( rendered == nullptr || rendered->frame == nullptr )
+                return 1;
+
+            *buffer = rendered->audio;
+            *bufferSize = rendered->audioSize;
+            *pts = rendered->audioPts;
             *dts = *pts;
+            mlt_log_debug( vlcConsumer->consumer(), "%ld", *pts );
 
-            if ( cleanup == true )
-                vlcConsumer->m_lastAudioFrame = frame;
-            else
-                vlcConsumer->m_videoFrames.push_back( frame );
+            vlcConsumer->lend( vlcConsumer->m_lentAudio, *buffer, rendered->frame );
         }
         else if ( cookie[0] == VLCConsumer::VideoCookie )
         {
-            std::shared_ptr<Mlt::Frame> frame;
-
-            bool cleanup;
-            if ( ( cleanup = vlcConsumer->m_videoFrames.size() > 0 ) )
-            {
-                frame = vlcConsumer->m_videoFrames.front();
-                vlcConsumer->m_videoFrames.pop_front();
-            }
-            else
-            {
-                frame = std::make_shared<Mlt::Frame>( mlt_consumer_rt_frame( vlcConsumer->m_parent->get_consumer() ) );
-                frame->dec_ref();
-            }
-
-            mlt_image_format videoFormat = mlt_image_yuv422;
-            int width = frame->get_int( "width" );
-            int height = frame->get_int( "height" );
-
-            *buffer = frame->get_image( videoFormat, width, height, 0 );
-            *bufferSize = mlt_image_format_size( videoFormat, width, height, NULL );
-            double ptsDiff = 1.0 / vlcConsumer->m_parent->get_double( "fps" ) * 1000000.0 + 0.5;
-
-            *pts = vlcConsumer->m_lastVideoPts + ptsDiff;
-            vlcConsumer->m_lastVideoPts = *pts;
+            Metrics::Timer timer( vlcConsumer->m_imemVideo );
+            auto rendered = vlcConsumer->m_renderAhead->takeVideo();
+            if ( rendered == nullptr || rendered->frame == nullptr )
+                return 1;
+
+            *buffer = rendered->image;
+            *bufferSize = rendered->imageSize;
+            *pts = rendered->videoPts;
             *dts = *pts;
 
-            if ( cleanup == true )
-                vlcConsumer->m_lastVideoFrame = frame;
-            else
-                vlcConsumer->m_audioFrames.push_back( frame );
+            vlcConsumer->lend( vlcConsumer->m_lentVideo, *buffer, rendered->frame );
         }
         else
             return 1;
 
+        vlcConsumer->publishQueueStats();
         return 0;
     }
 
+    // A frame whose buffer VLC holds.
+    struct Lent {
+        void*                       buffer;
+        std::shared_ptr<Mlt::Frame> frame;
+    };
+
+    // Keeps `frame`, which owns `buffer`, alive in `lent` while VLC holds the
+    // buffer.
+    void lend( std::deque<Lent>& lent, void* buffer, const std::shared_ptr<Mlt::Frame>& frame )
+    {
+        std::lock_guard<std::mutex> lck( m_safeLock );
+        lent.push_back( Lent{ buffer, frame } );
+    }
+
     static void imem_release( void* data, const char* cookie, size_t buffSize, void* buffer )
     {
         auto vlcConsumer = reinterpret_cast<VLCConsumer*>( data );
-        std::unique_lock<std::mutex> lck( vlcConsumer->m_safeLock );
+        if ( cookie[0] != VLCConsumer::AudioCookie && cookie[0] != VLCConsumer::VideoCookie )
+            return;
 
-        if ( cookie[0] == VLCConsumer::AudioCookie )
+        // Frames may share a buffer, e.g. a still image or a zero-copy
+        // producer's, so the buffer alone doesn't tell which frame it is. VLC
+        // gives buffers back in the order it took them, so it's the one lent
+        // first on this track.
+        auto& lent = cookie[0] == VLCConsumer::AudioCookie ? vlcConsumer->m_lentAudio : vlcConsumer->m_lentVideo;
+        std::shared_ptr<Mlt::Frame> frame;
         {
-            if ( vlcConsumer->m_lastAudioFrame == nullptr )
+            std::lock_guard<std::mutex> lck( vlcConsumer->m_safeLock );
+            auto it = lent.begin();
+            while ( it != lent.end() && it->buffer != buffer )
+                ++it;
+            if ( it == lent.end() )
                 return;
-            mlt_events_fire( vlcConsumer->m_parent->get_properties(),
-                            "consumer-frame-show", vlcConsumer->m_lastAudioFrame->get_frame(), NULL );
-            vlcConsumer->m_lastAudioFrame = nullptr;
-        }
-        else if ( cookie[0] == VLCConsumer::VideoCookie )
-        {
-            if ( vlcConsumer->m_lastVideoFrame == nullptr )
-                return;
-            mlt_events_fire( vlcConsumer->m_parent->get_properties(),
-                            "consumer-frame-show", vlcConsumer->m_lastVideoFrame->get_frame(), NULL );
-            vlcConsumer->m_lastVideoFrame = nullptr;
+            frame = std::move( it->frame );
+            lent.erase( it );
         }
+
+        mlt_events_fire( vlcConsumer->m_parent->get_properties(),
+                        "consumer-frame-show", frame->get_frame(), NULL );
+    }
+
+    void publishQueueStats()
+    {
+        m_parent->set( "queue.video", ( int ) m_renderAhead->videoQueued() );
+        m_parent->set( "queue.audio", ( int ) m_renderAhead->audioQueued() );
+        m_parent->set( "queue.bytes", m_renderAhead->bytes() );
+        m_parent->set( "queue.video_dropped", m_renderAhead->videoDropped() );
+        m_parent->set( "queue.audio_dropped", m_renderAhead->audioDropped() );
+        m_parent->set( "av_skew", m_renderAhead->avSkew() );
+        m_parent->set( "av_skew_max", m_renderAhead->avSkewMax() );
+        m_metrics.publish( m_parent->get_properties() );
     }
 
     static int consumer_start( mlt_consumer parent )
@@ -301,25 +406,30 @@ private:
 
     std::unique_ptr<Mlt::Consumer>      m_parent;
 
+    VLC::Instance&      m_instance;     // Used for every media of this consumer
     VLC::Media          m_media;
     VLC::MediaPlayer    m_mediaPlayer;
+    mlt_image_format    m_imageFormat;
 
-    std::mutex          m_safeLock;
+    std::mutex          m_safeLock;     // Guards m_lentVideo and m_lentAudio
 
-    std::shared_ptr<Mlt::Frame>         m_lastAudioFrame;
-    std::shared_ptr<Mlt::Frame>         m_lastVideoFrame;
+    std::unique_ptr<RenderAhead>        m_renderAhead;
 
-    // This is a trick to avoid calling mlt_consumer_rt_frame twice ( for audio and video ) for one frame.
-    std::deque<std::shared_ptr<Mlt::Frame>> m_audioFrames;
-    std::deque<std::shared_ptr<Mlt::Frame>> m_videoFrames;
+    Metrics::Histogram  m_imemVideo;        // imem_get, including the wait for a frame
+    Metrics::Histogram  m_imemAudio;
+    Metrics::Set        m_metrics;          // Goes first, it points to the above
 
-    int64_t             m_lastAudioPts;
-    int64_t             m_lastVideoPts;
+    // Frames owning the buffers VLC holds, per track in the order they were lent.
+    std::deque<Lent>    m_lentVideo;
+    std::deque<Lent>    m_lentAudio;
 
 };
 
 extern "C" mlt_consumer consumer_vlc_init_CXX( mlt_profile profile, mlt_service_type type , const char* id , char* arg )
 {
-    return ( new VLCConsumer( profile ) )->consumer();
+    auto vlcConsumer = new VLCConsumer( profile );
+    if ( arg != nullptr )
+        mlt_properties_set( MLT_CONSUMER_PROPERTIES( vlcConsumer->consumer() ), "target", arg );
+    return vlcConsumer->consumer();
 }
 
@@ -25,12 +25,18 @@
 
 #include <atomic>
 #include <string>
-#include <deque>
+#include <cstring>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
 #include <memory>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <map>
+
+#include <sys/stat.h>
 
 #include <mlt++/MltProfile.h>
 #include <mlt++/MltProducer.h>
@@ -38,286 +44,1095 @@
 #include <vlcpp/vlc.hpp>
 
 #include "common.hpp"
+#include "KeyframeIndex.hpp"
+#include "SPSCQueue.hpp"
+#include "ReadAhead.hpp"
+#include "AudioRing.hpp"
+#include "WorkerPool.hpp"
+#include "FrameCache.hpp"
+#include "Metrics.hpp"
 
 class VLCProducer
 {
 public:
-    VLCProducer( mlt_profile profile, char* file, mlt_producer parent = nullptr )
+    VLCProducer( mlt_profile profile, char* file, mlt_producer parent = nullptr, bool async = false )
         : m_parent( nullptr )
+        , m_instance( vlcInstance( file != nullptr ? file : "" ) )
+        , m_parking( false )
+        , m_opening( false )
+        , m_cancelOpen( false )
+        , m_openJob( 0 )
+        , m_videoFrames( VideoQueueCapacity )
+        , m_audioChunks( AudioQueueCapacity )
+        , m_audioWriting( nullptr )
+        , m_audioNextSample( 0 )
+        , m_audioHead( 0 )
+        , m_audioHeadGeneration( 0 )
+        , m_audioCursor( 0 )
+        , m_videoReadAhead( VideoQueueCapacity )
+        , m_audioReadAhead( AudioQueueCapacity )
         , m_audioIndex( -1 )
         , m_videoIndex( -1 )
-        , m_audioFramesTotalSize( 0 )
-        , m_videoLastPosition( -1 )
-        , m_videoLastPositionReal( 0 )
+        , m_videoCodec( 0 )
         , m_audioLastPosition( -1 )
         , m_audioExpected( 0 )
         , m_videoExpected( 0 )
-        , m_isAudioFrameReady( false )
-        , m_isVideoFrameReady( false )
-        , m_isAudioTooManyFrames( false )
-        , m_isVideoTooManyFrames( false )
-        , m_audioStopping( false )
-        , m_videoStopping( false )
-        , m_audioBufferLimit( 5 )
-        , m_videoBufferLimit( 5 )
+        , m_stopping( false )
+        , m_decoderState( Decoding )
+        , m_publishedState( nullptr )
+        , m_videoStarving( false )
+        , m_audioStarving( false )
+        , m_seekGeneration( 0 )
+        , m_audioGeneration( 0 )
+        , m_videoGeneration( 0 )
+        , m_videoQueuedGeneration( 0 )
+        , m_frameDuration( 40000 )
+        , m_ptsOrigin( 0 )
+        , m_videoSeekTarget( -1 )
+        , m_audioSeekSample( -1 )
+        , m_hasSeeked( false )
+        , m_seekPosition( -1 )
+        , m_videoHead( -40000 )
+        , m_seekCount( 0 )
+        , m_seekAvoidedCount( 0 )
+        , m_imageFormat( mlt_image_yuv420p )
+        , m_imageShown( false )
+        , m_formatRequests( 0 )
+        , m_decodeWidth( 0 )
+        , m_decodeHeight( 0 )
+        , m_cacheHits( 0 )
+        , m_cacheMisses( 0 )
+        , m_rate( 1 )
+        , m_audioShuttled( false )
+        , m_lastImageFormat( mlt_image_yuv420p )
+        , m_metrics( "producer" )
+        , m_lastShownPts( -1 )
     {
+        m_metrics.add( "video_wait_us", m_videoWait );
+        m_metrics.add( "audio_wait_us", m_audioWait );
+        m_metrics.add( "decoder_wait_us", m_decoderWait );
+        m_metrics.add( "wait_timeouts", m_waitTimeouts );
+        m_metrics.add( "frames_skipped", m_framesSkipped );
+        m_metrics.add( "frames_repeated", m_framesRepeated );
+
         if ( !file )
             return;
 
-        if ( parent == nullptr )
-            parent = new mlt_producer_s;
-        if ( mlt_producer_init( parent, this ) == 0 )
-        {
-            m_parent.reset( new Mlt::Producer( parent ) );
-            m_parent->dec_ref();
-
-            parent->get_frame = producer_get_frame;
-            parent->close = ( mlt_destructor ) producer_close;
-
-            m_parent->set_lcnumeric( "C" );
-            m_parent->set( "resource", file );
-            m_parent->set( "_profile", ( void* ) profile, 0, NULL, NULL );
-
-            m_media = VLC::Media( instance, std::string( file ), VLC::Media::FromType::FromLocation );
-
-            std::mutex preparseLock;
-            std::condition_variable preparseCond;
-            VLC::Media::ParsedStatus status;
-            bool done = false;
-            auto event = m_media.eventManager().onParsedChanged(
-                [&status, &done, &preparseLock, &preparseCond](VLC::Media::ParsedStatus s ) {
-                    std::lock_guard<std::mutex> lock( preparseLock );
-                    status = s;
-                    done = true;
-                    preparseCond.notify_all();
-                });
+        m_resource = file;
+        m_metrics.setLabel( m_resource );
+        if ( async == true )
+        {
+            // Don't hold up the loader unless the resource is already known.
+            m_info = cachedMediaInfo( m_resource );
+            if ( m_info == nullptr )
             {
-                std::unique_lock<std::mutex> lock( preparseLock );
-
-                if ( m_media.parseWithOptions( VLC::Media::ParseFlags::Local, 3000 ) == false )
-                    return;
-                preparseCond.wait( lock, [&done]() { return done == true; } );
+                if ( attach( profile, parent ) == true )
+                    openAsync();
+                return;
             }
-            event->unregister();
-            if ( status == VLC::Media::ParsedStatus::Done )
-            {
-                auto tracks = m_media.tracks();
-                m_parent->set( "meta.media.nb_streams", ( int ) tracks.size() );
-                int i = 0;
-                char key[200];
-                for ( const auto& track : tracks )
-                {
-                    if ( track.type() == VLC::MediaTrack::Video )
-                    {
-                        if ( m_videoIndex == -1 )
-                            m_videoIndex = i;
-
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.type", i );
-                        m_parent->set( key, "video" );
-
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate", i );
-                        m_parent->set( key, ( double ) track.fpsNum() / track.fpsDen() );
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_num", i );
-                        m_parent->set( key, ( int64_t ) track.fpsNum() );
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_den", i );
-                        m_parent->set( key, ( int64_t ) track.fpsDen() );
-
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate", i );
-                        m_parent->set( key, ( double ) track.fpsNum() / track.fpsDen() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_num", i );
-                        m_parent->set( key, ( int64_t ) track.fpsNum() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_den", i );
-                        m_parent->set( key, ( int64_t ) track.fpsDen() );
-
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.sample_aspect_ratio", i );
-                        m_parent->set( key, ( double ) track.sarNum() / track.sarDen() );
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_num", i );
-                        m_parent->set( key, ( int64_t ) track.sarNum() );
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_den", i );
-                        m_parent->set( key, ( int64_t ) track.sarDen() );
-
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.sample_aspect_ratio", i );
-                        m_parent->set( key, ( double ) track.sarNum() / track.sarDen() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_num", i );
-                        m_parent->set( key, ( int64_t ) track.sarNum() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codex.frame_rate_den", i );
-                        m_parent->set( key, ( int64_t ) track.sarDen() );
-
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.width", i );
-                        m_parent->set( key, ( int64_t ) track.width() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.height", i );
-                        m_parent->set( key, ( int64_t ) track.height() );
-                    }
-                    else if ( track.type() == VLC::MediaTrack::Audio )
-                    {
-                        if ( m_audioIndex == -1 )
-                            m_audioIndex = i;
-
-                        snprintf( key, sizeof(key), "meta.media.%d.stream.type", i );
-                        m_parent->set( key, "audio" );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.sample_rate", i );
-                        m_parent->set( key, ( int64_t ) track.rate() );
-                        snprintf( key, sizeof(key), "meta.media.%d.codec.channels", i );
-                        m_parent->set( key, ( int64_t ) track.channels() );
-                    }
-
-                    snprintf( key, sizeof(key), "meta.media.%d.codec.fourcc", i );
-                    m_parent->set( key, ( int64_t ) track.codec() );
-                    snprintf( key, sizeof(key), "meta.media.%d.codec.original_fourcc", i );
-                    m_parent->set( key, ( int64_t ) track.originalFourCC() );
-                    snprintf( key, sizeof(key), "meta.media.%d.codec.bit_rate", i );
-                    m_parent->set( key, ( int64_t ) track.bitrate() );
-                    i++;
-                }
+        }
+        else
+            m_info = mediaInfo( m_resource, m_instance );
 
-                if ( m_videoIndex != -1 )
-                {
-                    m_parent->set( "width", ( int64_t ) tracks[m_videoIndex].width() );
-                    m_parent->set( "meta.media.width", ( int64_t ) tracks[m_videoIndex].width() );
-                    m_parent->set( "height", ( int64_t ) tracks[m_videoIndex].height() );
-                    m_parent->set( "meta.media.height", ( int64_t ) tracks[m_videoIndex].height() );
-                    m_parent->set( "height", ( int64_t ) tracks[m_videoIndex].height() );
-                    m_parent->set( "meta.media.sample_aspect_num", ( int64_t ) tracks[m_videoIndex].sarNum() );
-                    m_parent->set( "meta.media.sample_aspect_den", ( int64_t ) tracks[m_videoIndex].sarDen() );
-                    m_parent->set( "aspect_ratio", ( double ) tracks[m_videoIndex].sarNum() / tracks[m_videoIndex].sarDen() );
-                    m_parent->set( "meta.media.frame_rate_num", ( int64_t ) tracks[m_videoIndex].fpsNum() );
-                    m_parent->set( "meta.media.frame_rate_den", ( int64_t ) tracks[m_videoIndex].fpsDen() );
-                    auto fps = ( double ) tracks[m_videoIndex].fpsNum() / tracks[m_videoIndex].fpsDen();
-                    m_parent->set( "frame_rate", fps );
-                    m_audioBufferLimit *= fps / m_parent->get_fps();
-                    m_videoBufferLimit *= fps / m_parent->get_fps();
-                    m_parent->set( "length",
-                                   ( int ) ( ( double ) m_media.duration() / 1000 * m_parent->get_fps() + 0.5 ) );
-                    m_parent->set( "out", ( int ) m_parent->get_int( "length" ) - 1 );
-                }
+        if ( attach( profile, parent ) == true && m_info != nullptr )
+            startPlayer();
+    }
 
-                if ( m_audioIndex != -1 )
+    // Returns an idle pipeline of a closed producer of `file`, attached to a
+    // new MLT producer, or nullptr if there is none.
+    static VLCProducer* lease( mlt_profile profile, const char* file )
+    {
+        if ( file == nullptr )
+            return nullptr;
+
+        auto info = cachedMediaInfo( file );
+        if ( info == nullptr )
+            return nullptr;
+
+        VLCProducer* vlcProducer = nullptr;
+        {
+            Pool& idle = pool();
+            std::lock_guard<std::mutex> lck( idle.lock );
+            for ( auto it = idle.producers.begin(); it != idle.producers.end(); ++it )
+            {
+                if ( ( *it )->m_info == info )
                 {
-                    m_parent->set( "meta.media.sample_rate", ( int64_t ) tracks[m_audioIndex].rate() );
-                    m_parent->set( "meta.media.channels", ( int64_t ) tracks[m_audioIndex].channels() );
-                    m_parent->set( "sample_rate", ( int64_t ) tracks[m_audioIndex].rate() );
-                    m_parent->set( "channels", ( int64_t ) tracks[m_audioIndex].channels() );
+                    vlcProducer = *it;
+                    idle.producers.erase( it );
+                    break;
                 }
-
-                char smem_options[ 1000 ];
-                sprintf( smem_options,
-                        ":sout=#transcode{"
-                        "vcodec=%s,"
-                        "}:smem{"
-                        "video-prerender-callback=%" PRIdPTR ","
-                        "video-postrender-callback=%" PRIdPTR ","
-                        "video-data=%" PRIdPTR ","
-                        "no-time-sync"
-                        "}",
-                        "YUY2",
-                        ( intptr_t ) &video_lock,
-                        ( intptr_t ) &video_unlock,
-                        ( intptr_t ) this
-                );
-
-                m_media.addOption( smem_options );
-                m_media.addOption( ":no-audio" );
-                m_media.addOption( ":no-sout-audio" );
-                m_videoMediaPlayer = VLC::MediaPlayer( m_media );
-
-                auto media = VLC::Media( instance, std::string( file ), VLC::Media::FromType::FromLocation );
-                sprintf( smem_options,
-                        ":sout=#transcode{"
-                        "acodec=%s,"
-                        "}:smem{"
-                        "audio-prerender-callback=%" PRIdPTR ","
-                        "audio-postrender-callback=%" PRIdPTR ","
-                        "audio-data=%" PRIdPTR ","
-                        "no-time-sync"
-                        "}",
-                        "s16l",
-                        ( intptr_t ) &audio_lock,
-                        ( intptr_t ) &audio_unlock,
-                        ( intptr_t ) this
-                );
-
-                media.addOption( smem_options );
-                media.addOption( ":no-video" );
-                media.addOption( ":no-sout-video" );
-                m_audioMediaPlayer = VLC::MediaPlayer( media );
             }
-            mlt_service_cache_put( MLT_PRODUCER_SERVICE( parent ), "vlcProducer", this, 0,
-                                   ( mlt_destructor ) vlc_producer_close );
         }
+        if ( vlcProducer == nullptr )
+            return nullptr;
+
+        if ( vlcProducer->attach( profile, nullptr ) == false )
+        {
+            delete vlcProducer;
+            return nullptr;
+        }
+        return vlcProducer;
     }
 
     mlt_producer producer()
     {
-        return m_parent->get_producer();
+        return m_parent != nullptr ? m_parent->get_producer() : nullptr;
     }
 
     bool isValid()
     {
-        return m_videoMediaPlayer.isValid() && m_audioMediaPlayer.isValid();
+        std::lock_guard<std::mutex> lck( m_openLock );
+        return m_opening == true || playerValid();
     }
 
     ~VLCProducer()
     {
+        cancelOpen();
         stop();
     }
 
 private:
 
+    // What a preparse found out about a resource.
+    struct MediaInfo {
+        std::vector<VLC::MediaTrack> tracks;
+        int64_t duration;       // In milliseconds
+        int64_t fileSize;
+        int64_t fileMtime;
+    };
+
+    // Idle pipelines of closed producers, oldest first.
+    struct Pool {
+        std::mutex lock;
+        std::list<VLCProducer*> producers;
+    };
+
+    static Pool& pool()
+    {
+        static Pool idle;
+        return idle;
+    }
+
+    // Returns the metadata of `resource`, preparsing it only the first time
+    // and again once the file changed, on `instance`. nullptr if it can't be
+    // parsed.
+    static std::shared_ptr<const MediaInfo> mediaInfo( const std::string& resource, VLC::Instance& instance )
+    {
+        auto info = cachedMediaInfo( resource );
+        if ( info != nullptr )
+            return info;
+
+        VLC::Media media( instance, resource, VLC::Media::FromType::FromLocation );
+
+        std::mutex preparseLock;
+        std::condition_variable preparseCond;
+        VLC::Media::ParsedStatus status;
+        bool done = false;
+        auto event = media.eventManager().onParsedChanged(
+            [&status, &done, &preparseLock, &preparseCond](VLC::Media::ParsedStatus s ) {
+                std::lock_guard<std::mutex> lock( preparseLock );
+                status = s;
+                done = true;
+                preparseCond.notify_all();
+            });
+        {
+            std::unique_lock<std::mutex> lock( preparseLock );
+
+            if ( media.parseWithOptions( VLC::Media::ParseFlags::Local, 3000 ) == false )
+                return nullptr;
+            preparseCond.wait( lock, [&done]() { return done == true; } );
+        }
+        event->unregister();
+        if ( status != VLC::Media::ParsedStatus::Done )
+            return nullptr;
+
+        auto parsed = std::make_shared<MediaInfo>();
+        parsed->tracks = media.tracks();
+        parsed->duration = media.duration();
+        fileStamp( resource, parsed->fileSize, parsed->fileMtime );
+
+        MediaInfoCache& cache = mediaInfoCache();
+        std::lock_guard<std::mutex> lck( cache.lock );
+        cache.infos[resource] = parsed;
+        return parsed;
+    }
+
+    struct MediaInfoCache {
+        std::mutex lock;
+        std::map<std::string, std::shared_ptr<const MediaInfo>> infos;
+    };
+
+    static MediaInfoCache& mediaInfoCache()
+    {
+        static MediaInfoCache cache;
+        return cache;
+    }
+
+    static void fileStamp( const std::string& resource, int64_t& size, int64_t& mtime )
+    {
+        struct stat st;
+        size = mtime = -1;
+        if ( stat( resource.c_str(), &st ) == 0 )
+        {
+            size = st.st_size;
+            mtime = st.st_mtime;
+        }
+    }
+
+    // The metadata of `resource` if it was parsed before and the file didn't
+    // change since, or nullptr.
+    static std::shared_ptr<const MediaInfo> cachedMediaInfo( const std::string& resource )
+    {
+        int64_t fileSize, fileMtime;
+        fileStamp( resource, fileSize, fileMtime );
+
+        MediaInfoCache& cache = mediaInfoCache();
+        std::lock_guard<std::mutex> lck( cache.lock );
+        auto it = cache.infos.find( resource );
+        if ( it != cache.infos.end() && it->second->fileSize == fileSize && it->second->fileMtime == fileMtime )
+            return it->second;
+        return nullptr;
+    }
+
+    static WorkerPool& preparsePool()
+    {
+        static WorkerPool pool( PreparseThreads );
+        return pool;
+    }
+
+    // Preparses on the worker pool, then fills in the metadata, starts the
+    // player and fires "producer-preparsed".
+    void openAsync()
+    {
+        std::lock_guard<std::mutex> openLck( m_openLock );
+        m_opening = true;
+        m_openJob = preparsePool().submit( [this]() {
+            std::shared_ptr<const MediaInfo> info;
+            if ( m_cancelOpen == false )
+                info = mediaInfo( m_resource, m_instance );
+
+            std::unique_lock<std::mutex> lck( m_openLock );
+            if ( m_cancelOpen == false && info != nullptr )
+            {
+                m_info = info;
+                applyMediaInfo();
+                startPlayer();
+                m_openCond.notify_all();
+
+                // Listeners may already ask for frames.
+                lck.unlock();
+                mlt_events_fire( m_parent->get_properties(), "producer-preparsed", NULL );
+                lck.lock();
+            }
+            m_opening = false;
+            m_openCond.notify_all();
+        });
+    }
+
+    // Waits until the player of a pending openAsync() runs, or the open
+    // failed. Frames can't be rendered before.
+    void waitOpened()
+    {
+        std::unique_lock<std::mutex> lck( m_openLock );
+        m_openCond.wait( lck, [this]() { return m_opening == false || playerValid() == true; } );
+    }
+
+    // Makes a pending openAsync() give up. A preparse still queued is
+    // dropped, one already running is waited for.
+    void cancelOpen()
+    {
+        std::unique_lock<std::mutex> lck( m_openLock );
+        m_cancelOpen = true;
+        if ( m_opening == true && preparsePool().cancel( m_openJob ) == true )
+            m_opening = false;
+        m_openCond.wait( lck, [this]() { return m_opening == false; } );
+    }
+
+    void startPlayer()
+    {
+        m_videoHead = -m_frameDuration;
+        // Played from the start, audio is lined up the same way as after a
+        // seek, so both give the same samples.
+        m_audioSeekSample = 0;
+        m_audioCursor = 0;
+        m_audioHeadGeneration = m_seekGeneration - 1;
+        m_videoQueuedGeneration = m_seekGeneration - 1;
+        if ( m_audioIndex != -1 )
+            m_audioRing.reset( m_parent->get_int( "channels" ) * sizeof( int16_t ),
+                               m_parent->get_int( "sample_rate" ) * AudioRingSeconds );
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        m_seekPosition = 0;
+        createPlayer();
+    }
+
+    // Initialises `parent`, or a new MLT producer if it's nullptr, as the
+    // producer of this pipeline and fills in the metadata.
+    bool attach( mlt_profile profile, mlt_producer parent )
+    {
+        if ( parent == nullptr )
+            parent = new mlt_producer_s;
+        if ( mlt_producer_init( parent, this ) != 0 )
+            return false;
+
+        m_parent.reset( new Mlt::Producer( parent ) );
+        m_parent->dec_ref();
+
+        parent->get_frame = producer_get_frame;
+        parent->close = ( mlt_destructor ) producer_close;
+
+        m_parent->set_lcnumeric( "C" );
+        m_parent->set( "resource", m_resource.c_str() );
+        m_parent->set( "_profile", ( void* ) profile, 0, NULL, NULL );
+        m_parent->set( "readahead.budget", DefaultReadAheadBudget );
+        m_parent->set( "decoder.scale", 1 );
+        m_parent->set( "cache.budget", 0 );
+        m_parent->set( "reverse_window", DefaultReverseWindow );
+        m_parent->set( "decoder.deadline", DefaultDecoderDeadline );
+
+        m_imageShown = false;
+        m_publishedState = nullptr;
+        {
+            std::lock_guard<std::mutex> lck( m_lastImageLock );
+            m_lastImage.reset();
+        }
+        m_formatRequests = 0;
+        m_seekCount = 0;
+        m_seekAvoidedCount = 0;
+        m_cacheHits = 0;
+        m_cacheMisses = 0;
+
+        mlt_events_register( m_parent->get_properties(), "producer-preparsed", NULL );
+        mlt_service_cache_put( MLT_PRODUCER_SERVICE( parent ), "vlcProducer", this, 0,
+                               ( mlt_destructor ) vlc_producer_close );
+
+        if ( m_info != nullptr )
+            applyMediaInfo();
+        return true;
+    }
+
+    // Publishes m_info as the meta.media.* properties, length and out.
+    void applyMediaInfo()
+    {
+        const auto& tracks = m_info->tracks;
+        m_parent->set( "meta.media.nb_streams", ( int ) tracks.size() );
+        int i = 0;
+        char key[200];
+        for ( const auto& track : tracks )
+        {
+            if ( track.type() == VLC::MediaTrack::Video )
+            {
+                if ( m_videoIndex == -1 )
+                {
+                    m_videoIndex = i;
+                    m_videoCodec = track.codec();
+                }
+
+                snprintf( key, sizeof(key), "meta.media.%d.stream.type", i );
+                m_parent->set( key, "video" );
+
+                snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate", i );
+                m_parent->set( key, ( double ) track.fpsNum() / track.fpsDen() );
+                snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_num", i );
+                m_parent->set( key, ( int64_t ) track.fpsNum() );
+                snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_den", i );
+                m_parent->set( key, ( int64_t ) track.fpsDen() );
+
+                snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate", i );
+                m_parent->set( key, ( double ) track.fpsNum() / track.fpsDen() );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_num", i );
+                m_parent->set( key, ( int64_t ) track.fpsNum() );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_den", i );
+                m_parent->set( key, ( int64_t ) track.fpsDen() );
+
+                snprintf( key, sizeof(key), "meta.media.%d.stream.sample_aspect_ratio", i );
+                m_parent->set( key, ( double ) track.sarNum() / track.sarDen() );
+                snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_num", i );
+                m_parent->set( key, ( int64_t ) track.sarNum() );
+                snprintf( key, sizeof(key), "meta.media.%d.stream.frame_rate_den", i );
+                m_parent->set( key, ( int64_t ) track.sarDen() );
+
+                snprintf( key, sizeof(key), "meta.media.%d.codec.sample_aspect_ratio", i );
+                m_parent->set( key, ( double ) track.sarNum() / track.sarDen() );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.frame_rate_num", i );
+                m_parent->set( key, ( int64_t ) track.sarNum() );
+                snprintf( key, sizeof(key), "meta.media.%d.codex.frame_rate_den", i );
+                m_parent->set( key, ( int64_t ) track.sarDen() );
+
+                snprintf( key, sizeof(key), "meta.media.%d.codec.width", i );
+                m_parent->set( key, ( int64_t ) track.width() );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.height", i );
+                m_parent->set( key, ( int64_t ) track.height() );
+            }
+            else if ( track.type() == VLC::MediaTrack::Audio )
+            {
+                if ( m_audioIndex == -1 )
+                    m_audioIndex = i;
+
+                snprintf( key, sizeof(key), "meta.media.%d.stream.type", i );
+                m_parent->set( key, "audio" );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.sample_rate", i );
+                m_parent->set( key, ( int64_t ) track.rate() );
+                snprintf( key, sizeof(key), "meta.media.%d.codec.channels", i );
+                m_parent->set( key, ( int64_t ) track.channels() );
+            }
+
+            snprintf( key, sizeof(key), "meta.media.%d.codec.fourcc", i );
+            m_parent->set( key, ( int64_t ) track.codec() );
+            snprintf( key, sizeof(key), "meta.media.%d.codec.original_fourcc", i );
+            m_parent->set( key, ( int64_t ) track.originalFourCC() );
+            snprintf( key, sizeof(key), "meta.media.%d.codec.bit_rate", i );
+            m_parent->set( key, ( int64_t ) track.bitrate() );
+            i++;
+        }
+
+        if ( m_videoIndex != -1 )
+        {
+            m_parent->set( "width", ( int64_t ) tracks[m_videoIndex].width() );
+            m_parent->set( "meta.media.width", ( int64_t ) tracks[m_videoIndex].width() );
+            m_parent->set( "height", ( int64_t ) tracks[m_videoIndex].height() );
+            m_parent->set( "meta.media.height", ( int64_t ) tracks[m_videoIndex].height() );
+            m_parent->set( "height", ( int64_t ) tracks[m_videoIndex].height() );
+            m_parent->set( "meta.media.sample_aspect_num", ( int64_t ) tracks[m_videoIndex].sarNum() );
+            m_parent->set( "meta.media.sample_aspect_den", ( int64_t ) tracks[m_videoIndex].sarDen() );
+            m_parent->set( "aspect_ratio", ( double ) tracks[m_videoIndex].sarNum() / tracks[m_videoIndex].sarDen() );
+            m_parent->set( "meta.media.frame_rate_num", ( int64_t ) tracks[m_videoIndex].fpsNum() );
+            m_parent->set( "meta.media.frame_rate_den", ( int64_t ) tracks[m_videoIndex].fpsDen() );
+            // Elementary streams, MPEG-TS and some Matroska files don't tell,
+            // so frames are assumed to last as long as the profile's then.
+            if ( tracks[m_videoIndex].fpsNum() != 0 && tracks[m_videoIndex].fpsDen() != 0 )
+            {
+                auto fps = ( double ) tracks[m_videoIndex].fpsNum() / tracks[m_videoIndex].fpsDen();
+                m_parent->set( "frame_rate", fps );
+                m_frameDuration = ( int64_t ) tracks[m_videoIndex].fpsDen() * 1000000 / tracks[m_videoIndex].fpsNum();
+            }
+            else
+                m_frameDuration = ( int64_t ) ( 1000000 / m_parent->get_fps() + 0.5 );
+            // Keep an out point set while the preparse was still running.
+            const int oldLength = m_parent->get_int( "length" );
+            m_parent->set( "length",
+                           ( int ) ( ( double ) m_info->duration / 1000 * m_parent->get_fps() + 0.5 ) );
+            if ( m_parent->get_int( "out" ) == oldLength - 1 || m_parent->get_int( "out" ) >= m_parent->get_int( "length" ) )
+                m_parent->set( "out", ( int ) m_parent->get_int( "length" ) - 1 );
+        }
+
+        if ( m_audioIndex != -1 )
+        {
+            m_parent->set( "meta.media.sample_rate", ( int64_t ) tracks[m_audioIndex].rate() );
+            m_parent->set( "meta.media.channels", ( int64_t ) tracks[m_audioIndex].channels() );
+            m_parent->set( "sample_rate", ( int64_t ) tracks[m_audioIndex].rate() );
+            m_parent->set( "channels", ( int64_t ) tracks[m_audioIndex].channels() );
+        }
+    }
+
+    // Keeps the running pipeline of a closed producer for lease(), evicting
+    // the oldest idle one beyond IdlePipelines.
+    void park()
+    {
+        m_parking = false;
+        m_parent.reset();
+
+        VLCProducer* evicted = nullptr;
+        {
+            Pool& idle = pool();
+            std::lock_guard<std::mutex> lck( idle.lock );
+            idle.producers.push_back( this );
+            if ( idle.producers.size() > IdlePipelines )
+            {
+                evicted = idle.producers.front();
+                idle.producers.pop_front();
+            }
+        }
+        delete evicted;
+    }
+
+    // Whether the decoder may still deliver something.
+    enum DecoderState {
+        Decoding,
+        Ended,      // Reached the end of the media
+        Failed,     // VLC reported an error
+    };
+
+    // A slot of the frame queues, filled by the smem callbacks.
     struct Frame {
+        Frame()
+            : buffer( nullptr )
+            , size( 0 )
+            , width( 0 )
+            , height( 0 )
+            , pts( 0 )
+            , generation( 0 )
+            , first( false )
+        {
+        }
+
+        Frame( const Frame& ) = delete;
+        Frame& operator=( const Frame& ) = delete;
+
         ~Frame()
         {
-            mlt_pool_release( buffer );
+            FrameBuffer::release( buffer );
+        }
+
+        void reset()
+        {
+            FrameBuffer::release( buffer );
+            buffer = nullptr;
         }
 
         uint8_t* buffer;
         int size;
-        unsigned iterator;
+        int width;
+        int height;
+        int64_t pts;
+        uint32_t generation;    // m_seekGeneration when it was decoded
+        bool first;             // The first one queued of its generation
+    };
+
+    // A slot of the audio chunk queue. The samples themselves are in
+    // m_audioRing, in the same order. Chunks needn't follow each other: what
+    // lies between two of them was dropped, and is played as silence.
+    struct AudioChunk {
+        AudioChunk()
+            : position( 0 )
+            , sample( 0 )
+            , samples( 0 )
+            , generation( 0 )
+        {
+        }
+
+        void reset()
+        {
+        }
+
+        // Media sample at ring position `position`, which may lie past the
+        // chunk.
+        int64_t sampleAt( int64_t position ) const
+        {
+            return sample + position - this->position;
+        }
+
+        int64_t position;       // Ring position of the first sample
+        int64_t sample;         // Media sample of the first sample
+        size_t samples;
+        uint32_t generation;
     };
 
-    void audioStop()
+    void stop()
+    {
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        stopPlayer();
+    }
+
+    // m_playerLock must be held.
+    void stopPlayer()
     {
-        m_audioStopping = true;
+        m_stopping = true;
 
-        if ( m_audioMediaPlayer.isValid() == true )
+        if ( m_mediaPlayer.isValid() == true )
         {
-            m_audioTooManyFramesCond.notify_all();
-            m_audioMediaPlayer.stop();
+            m_audioChunks.produced().wake();
+            m_audioChunks.consumed().wake();
+            m_videoFrames.produced().wake();
+            m_videoFrames.consumed().wake();
+            m_mediaPlayer.stop();
         }
     }
 
-    void videoStop()
+    // Converts a smem timestamp to media time, both in microseconds.
+    int64_t mediaTime( int64_t pts )
     {
-        m_videoStopping = true;
+        int64_t origin = m_ptsOrigin;
+        return pts - ( origin != 0 ? origin : 1 );
+    }
 
-        if ( m_videoMediaPlayer.isValid() == true )
+    void calibrate( int64_t pts )
+    {
+        // The first timestamp of a clip played from its start is its origin.
+        // If we had to seek first we fall back to VLC's zero timestamp.
+        int64_t unknown = 0;
+        if ( m_hasSeeked == false && pts > 0 )
+            m_ptsOrigin.compare_exchange_strong( unknown, pts );
+    }
+
+    // Maps an MLT image format to the chroma smem is asked for, or nullptr if
+    // VLC can't output it.
+    static const char* vlcChroma( mlt_image_format format )
+    {
+        switch ( format )
         {
-            m_videoTooManyFramesCond.notify_all();
-            m_videoMediaPlayer.stop();
+        case mlt_image_yuv420p:
+            return "I420";
+        case mlt_image_yuv422:
+            return "YUY2";
+        case mlt_image_rgb24a:
+            return "RGBA";
+        default:
+            return nullptr;
         }
     }
 
-    void stop()
+    // (Re)creates the player, starting at media time `start` in microseconds.
+    // m_playerLock must be held.
+    void createPlayer( int64_t start = 0 )
+    {
+        m_media = VLC::Media( m_instance, m_resource, VLC::Media::FromType::FromLocation );
+
+        // Both elementary streams go through the same demuxer and the same smem
+        // instance, so a file is only read and demuxed once. The audio layout
+        // is pinned to what m_audioRing was sized for.
+        char scaling[ 64 ] = "";
+        if ( m_decodeWidth > 0 && m_decodeHeight > 0 )
+            snprintf( scaling, sizeof( scaling ), "width=%d,height=%d,", m_decodeWidth, m_decodeHeight );
+        char smem_options[ 1000 ];
+        sprintf( smem_options,
+                ":sout=#transcode{"
+                "vcodec=%s,"
+                "%s"
+                "acodec=%s,"
+                "channels=%d,"
+                "samplerate=%d,"
+                "}:smem{"
+                "video-prerender-callback=%" PRIdPTR ","
+                "video-postrender-callback=%" PRIdPTR ","
+                "video-data=%" PRIdPTR ","
+                "audio-prerender-callback=%" PRIdPTR ","
+                "audio-postrender-callback=%" PRIdPTR ","
+                "audio-data=%" PRIdPTR ","
+                "no-time-sync"
+                "}",
+                vlcChroma( m_imageFormat ),
+                scaling,
+                "s16l",
+                m_parent->get_int( "channels" ),
+                m_parent->get_int( "sample_rate" ),
+                ( intptr_t ) &video_lock,
+                ( intptr_t ) &video_unlock,
+                ( intptr_t ) this,
+                ( intptr_t ) &audio_lock,
+                ( intptr_t ) &audio_unlock,
+                ( intptr_t ) this
+        );
+        m_media.addOption( smem_options );
+
+        m_decoderOptions = decoderOptions();
+        m_rate = 1;
+        for ( const auto& option : m_decoderOptions )
+            m_media.addOption( option );
+
+        if ( start > 0 )
+        {
+            char start_option[ 64 ];
+            snprintf( start_option, sizeof( start_option ), ":start-time=%.6f", ( double ) start / 1000000.0 );
+            m_media.addOption( start_option );
+        }
+
+        m_mediaPlayer = VLC::MediaPlayer( m_media );
+        m_decoderState = Decoding;
+        // Wake whoever waits for the decoder right away, rather than letting
+        // them run into their deadline.
+        m_mediaPlayer.eventManager().onEndReached( [this]() { decoderStopped( Ended ); } );
+        m_mediaPlayer.eventManager().onEncounteredError( [this]() { decoderStopped( Failed ); } );
+    }
+
+    // Called from VLC's event thread, so it must not call back into VLC.
+    void decoderStopped( DecoderState state )
+    {
+        m_decoderState = state;
+        m_videoFrames.produced().wake();
+        m_audioChunks.produced().wake();
+    }
+
+    // When get_image and get_audio stop waiting for a slow decoder. In real
+    // time mode they don't wait at all if `fallback`, i.e. if there is
+    // something else to show.
+    std::chrono::steady_clock::time_point waitDeadline( bool fallback )
+    {
+        int deadline = std::max( m_parent->get_int( "decoder.deadline" ), 0 );
+        if ( fallback == true && m_parent->get_int( "real_time" ) != 0 )
+            deadline = 0;
+        return std::chrono::steady_clock::now() + std::chrono::milliseconds( deadline );
+    }
+
+    // Publishes decoder.state: decoding, stalled (the deadline passed),
+    // ended or error.
+    void publishState( bool stalled )
+    {
+        const int state = m_decoderState;
+        const char* name = state == Ended ? "ended" : state == Failed ? "error" : stalled == true ? "stalled" : "decoding";
+        if ( name != m_publishedState )
+        {
+            m_parent->set( "decoder.state", name );
+            m_publishedState = name;
+        }
+    }
+
+    // Keeps a reference to the image last shown, to show again when the
+    // decoder has nothing.
+    void rememberImage( uint8_t* buffer, size_t size, int width, int height )
+    {
+        std::lock_guard<std::mutex> lck( m_lastImageLock );
+        FrameBuffer::ref( buffer );
+        m_lastImage.reset();
+        m_lastImage.buffer = buffer;
+        m_lastImage.size = size;
+        m_lastImage.width = width;
+        m_lastImage.height = height;
+        m_lastImageFormat = m_imageFormat;
+    }
+
+    // A new reference to the image last shown, nullptr if there is none in
+    // the current format.
+    uint8_t* lastImage( size_t* size, int* width, int* height )
+    {
+        std::lock_guard<std::mutex> lck( m_lastImageLock );
+        if ( m_lastImage.buffer == nullptr || m_lastImageFormat != m_imageFormat )
+            return nullptr;
+        *size = m_lastImage.size;
+        *width = m_lastImage.width;
+        *height = m_lastImage.height;
+        return FrameBuffer::ref( m_lastImage.buffer );
+    }
+
+    bool hasLastImage()
+    {
+        std::lock_guard<std::mutex> lck( m_lastImageLock );
+        return m_lastImage.buffer != nullptr && m_lastImageFormat == m_imageFormat;
+    }
+
+    // Per-media avcodec options from the decoder.* and preview_quality
+    // properties. Previews trade the loop filter and some IDCT precision on
+    // frames nothing refers to for decoding speed.
+    std::vector<std::string> decoderOptions()
+    {
+        std::vector<std::string> options;
+        const int threads = m_parent->get_int( "decoder.threads" );
+        if ( threads > 0 )
+            options.push_back( ":avcodec-threads=" + std::to_string( threads ) );
+        const char* threading = m_parent->get( "decoder.threading" );
+        if ( threading != nullptr && ( strcmp( threading, "frame" ) == 0 || strcmp( threading, "slice" ) == 0 ) )
+            options.push_back( std::string( ":avcodec-options={thread_type=" ) + threading + "}" );
+
+        const int quality = m_parent->get_int( "preview_quality" );
+        if ( m_parent->get_int( "decoder.fast" ) != 0 || quality > 0 )
+            options.push_back( ":avcodec-fast" );
+        if ( quality == 1 )
+            options.push_back( ":avcodec-skiploopfilter=1" );
+        else if ( quality >= 2 )
+        {
+            options.push_back( ":avcodec-skiploopfilter=4" );
+            options.push_back( ":avcodec-skip-idct=1" );
+        }
+        return options;
+    }
+
+    // The size to decode images at for a request of `width`x`height`, 0x0 for
+    // the source's own. Only ever scales down, so previews don't make MLT
+    // rescale full size frames, while full size renders stay untouched.
+    void decodeSize( int width, int height, int* decodeWidth, int* decodeHeight )
+    {
+        *decodeWidth = 0;
+        *decodeHeight = 0;
+        if ( m_parent->get_int( "decoder.scale" ) == 0 || width <= 0 || height <= 0 ||
+             width % 2 != 0 || height % 2 != 0 )
+            return;
+        const int sourceWidth = m_parent->get_int( "width" );
+        const int sourceHeight = m_parent->get_int( "height" );
+        if ( width > sourceWidth || height > sourceHeight || ( width == sourceWidth && height == sourceHeight ) )
+            return;
+        *decodeWidth = width;
+        *decodeHeight = height;
+    }
+
+    // Rebuilds the decoding chain, e.g. after the image format changed, and
+    // resumes at `position`. m_playerLock must be held, neither queue lock
+    // may be.
+    void restart( mlt_position position )
+    {
+        stopPlayer();
+        m_stopping = false;
+        createPlayer( prepareSeek( position ) );
+    }
+
+    // Audio and video share one player, so a seek requested by either side
+    // repositions both queues, and the other side won't seek again for the
+    // same position. Returns the media time the player should seek to.
+    int64_t prepareSeek( mlt_position position )
+    {
+        int64_t target = positionToTime( position );
+        int64_t keyframe = -1;
+        {
+            std::lock( m_videoLock, m_audioLock );
+            std::lock_guard<std::mutex> videoLck( m_videoLock, std::adopt_lock );
+            std::lock_guard<std::mutex> audioLck( m_audioLock, std::adopt_lock );
+
+            if ( m_keyframeIndex != nullptr )
+                keyframe = m_keyframeIndex->keyframeBefore( target );
+
+            // Frames the decoders are still delivering from before the seek are
+            // recognised by their generation and dropped by the consumers. The
+            // audio target is set first, so a chunk of the new generation
+            // can't miss it.
+            m_audioSeekSample = audioSampleAt( position );
+            m_audioCursor = m_audioSeekSample;
+            m_seekGeneration++;
+            m_videoFrames.clear();
+            popAudio( m_audioRing.size() );
+            m_videoSeekTarget = target;
+            m_hasSeeked = true;
+            m_videoReadAhead.discontinuity();
+            m_audioReadAhead.discontinuity();
+
+            m_videoHead = target - m_frameDuration;
+            m_videoExpected = position;
+            m_audioExpected = position;
+            m_seekPosition = position;
+        }
+
+        // Seek to the keyframe itself when it's known, rounding up so the demuxer
+        // doesn't go back to the one before. The lock callbacks drop what precedes
+        // the target, which makes the seek frame accurate.
+        return keyframe >= 0 ? ( keyframe + 999 ) / 1000 * 1000 : target;
+    }
+
+    // The first sample of `position`, as linear playback from the start hands
+    // them out.
+    int64_t audioSampleAt( mlt_position position )
+    {
+        return mlt_sample_calculator_to_now( m_parent->get_fps(), m_parent->get_int( "sample_rate" ), position );
+    }
+
+    // The media sample played at smem timestamp `pts`.
+    int64_t sampleAt( int64_t pts, unsigned int rate )
+    {
+        const int64_t time = mediaTime( pts );
+        return ( time * rate + ( time >= 0 ? 500000 : -500000 ) ) / 1000000;
+    }
+
+    // Whether there is a player to decode with.
+    bool playerValid()
+    {
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        return m_mediaPlayer.isValid();
+    }
+
+    // Starts the player unless it runs already or has nothing left to decode.
+    // An ended player would start over. Neither queue lock may be held.
+    void resume()
+    {
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        if ( m_decoderState == Decoding && m_mediaPlayer.isPlaying() == false )
+            m_mediaPlayer.play();
+    }
+
+    // Returns false if the other side got the player to `position` while we
+    // waited for it. Neither queue lock may be held.
+    bool seek( mlt_position position )
+    {
+        // Both sides tend to ask at once, e.g. every time the player ended.
+        // Only the first one rebuilds or seeks, the other just waits for it.
+        const uint32_t generation = m_seekGeneration;
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        if ( m_seekGeneration != generation && m_seekPosition == position )
+            return false;
+
+        // A player that ended or failed doesn't seek anymore.
+        if ( m_decoderState != Decoding )
+        {
+            restart( position );
+            m_mediaPlayer.play();
+            return true;
+        }
+        m_mediaPlayer.setTime( prepareSeek( position ) / 1000 );
+        return true;
+    }
+
+    // Consumes `samples` samples, popping the chunks that are done with.
+    // m_audioLock must be held.
+    void popAudio( size_t samples )
+    {
+        m_audioRing.pop( samples );
+        const int64_t read = m_audioRing.readPosition();
+        while ( m_audioChunks.empty() == false &&
+                m_audioChunks.front().position + ( int64_t ) m_audioChunks.front().samples <= read )
+            m_audioChunks.pop();
+    }
+
+    // Ring position up to which samples are committed. m_audioLock must be
+    // held.
+    int64_t audioCommitted()
+    {
+        return m_audioRing.readPosition() + m_audioRing.size();
+    }
+
+    // A chunk is queued just before its samples are committed, so only drop
+    // it once they are. m_audioLock must be held.
+    void dropStaleAudio()
+    {
+        while ( m_audioChunks.empty() == false && m_audioChunks.front().generation != m_seekGeneration )
+        {
+            const AudioChunk& chunk = m_audioChunks.front();
+            const int64_t end = chunk.position + chunk.samples;
+            if ( audioCommitted() < end )
+                break;
+            popAudio( end - m_audioRing.readPosition() );
+        }
+    }
+
+    // The media sample following the last one committed in the current
+    // generation, -1 if none is yet.
+    int64_t audioHead()
+    {
+        if ( m_audioHeadGeneration != m_seekGeneration )
+            return -1;
+        return m_audioHead;
+    }
+
+    // Copies media samples `start` to `start` + `samples` to `out`, with
+    // silence where nothing was decoded, and consumes everything before them.
+    // What isn't decoded yet is left as it is in `out`, and is skipped once it
+    // arrives. m_audioLock must be held.
+    void readAudio( uint8_t* out, int64_t start, size_t samples )
+    {
+        const size_t frameBytes = m_audioRing.frameBytes();
+        const int64_t end = start + samples;
+        m_audioCursor = start;
+        while ( samples > 0 && m_audioChunks.empty() == false )
+        {
+            const AudioChunk& chunk = m_audioChunks.front();
+            // A stale chunk that isn't committed yet maps to nothing here.
+            if ( chunk.generation != m_seekGeneration )
+                break;
+            const int64_t read = m_audioRing.readPosition();
+            const int64_t front = chunk.sampleAt( read );
+            // Committed samples of the chunk still in the ring.
+            const int64_t left = std::min<int64_t>( chunk.position + chunk.samples, audioCommitted() ) - read;
+            size_t count;
+            if ( front > m_audioCursor )
+            {
+                count = std::min<int64_t>( front - m_audioCursor, samples );
+                memset( out, 0, count * frameBytes );
+            }
+            else if ( front < m_audioCursor )
+            {
+                // Already played, or owed to a seek: skip it.
+                if ( left <= 0 )
+                    break;
+                popAudio( std::min<int64_t>( m_audioCursor - front, left ) );
+                continue;
+            }
+            else
+            {
+                // The ring is contiguous across its wrap, so a chunk is one span.
+                if ( left <= 0 )
+                    break;
+                count = std::min<int64_t>( left, samples );
+                memcpy( out, m_audioRing.readPointer(), count * frameBytes );
+                popAudio( count );
+            }
+            out += count * frameBytes;
+            samples -= count;
+            m_audioCursor += count;
+        }
+        m_audioCursor = end;
+    }
+
+    int64_t audioBytes()
+    {
+        return m_audioRing.size() * m_audioRing.frameBytes();
+    }
+
+    // m_videoLock must be held.
+    void dropStaleVideo()
+    {
+        while ( m_videoFrames.empty() == false && m_videoFrames.front().generation != m_seekGeneration )
+            m_videoFrames.pop();
+    }
+
+    // Waits in a smem thread until `frames` is below its read-ahead depth. The
+    // demuxer is shared, so while the other side is starving we stop waiting:
+    // blocking one decoder would hold back the other.
+    template <typename T>
+    bool waitForRoom( SPSCQueue<T>& frames, ReadAhead& readAhead, std::atomic_bool& otherStarving )
+    {
+        const int64_t start = ReadAhead::now();
+        for ( ;; )
+        {
+            uint32_t seq = frames.consumed().value();
+            if ( frames.size() < readAhead.depth() || otherStarving == true || m_stopping == true )
+                break;
+            frames.consumed().wait( seq, std::chrono::milliseconds( 1000 ) );
+        }
+        const int64_t blocked = ReadAhead::now() - start;
+        readAhead.blocked( blocked );
+        m_decoderWait.record( blocked );
+        return frames.full() == false;
+    }
+
+    // Waits for the decoder to produce into `queue` until `deadline`, timing
+    // the wait in `histogram`. False if nothing more is coming in time: the
+    // decoder ended, failed or is too slow.
+    template <typename T>
+    bool waitProduced( SPSCQueue<T>& queue, uint32_t seq, std::chrono::steady_clock::time_point deadline,
+                       Metrics::Histogram& histogram )
+    {
+        if ( m_decoderState != Decoding )
+            return false;
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>( deadline - std::chrono::steady_clock::now() );
+        bool woken = false;
+        if ( left.count() > 0 )
+        {
+            Metrics::Timer timer( histogram );
+            woken = queue.produced().wait( seq, left );
+        }
+        if ( woken == false )
+            m_waitTimeouts.add();
+        return woken;
+    }
+
+    void publishStats()
+    {
+        if ( Metrics::enabled() == false )
+            return;
+        m_metrics.publish( m_parent->get_properties() );
+        m_parent->set( "stats.video_queue", ( int ) m_videoFrames.size() );
+        m_parent->set( "stats.audio_queue", ( int64_t ) m_audioRing.size() );
+        m_parent->set( "stats.pool_bytes", FrameBuffer::bytes() );
+    }
+
+    // Records a pull in `readAhead` and publishes the resulting depth and the
+    // bytes buffered as readahead.<name>.* properties.
+    void pulled( ReadAhead& readAhead, const char* name, double items, bool underrun,
+                 int64_t bytes, int64_t otherBytes )
     {
-        audioStop();
-        videoStop();
+        readAhead.pulled( items, underrun, m_parent->get_int64( "readahead.budget" ), otherBytes );
+
+        char key[64];
+        snprintf( key, sizeof( key ), "readahead.%s.depth", name );
+        m_parent->set( key, ( int ) readAhead.depth() );
+        snprintf( key, sizeof( key ), "readahead.%s.bytes", name );
+        m_parent->set( key, bytes );
     }
 
     static void audio_lock( void* data, uint8_t** buffer, size_t size )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( data );
-        std::unique_lock<std::mutex> lck( vlcProducer->m_audioLock );
 
-        if ( vlcProducer->m_audioFrames.size() >= vlcProducer->m_audioBufferLimit )
-            vlcProducer->m_isAudioTooManyFrames = true;
-        else
-            vlcProducer->m_isAudioTooManyFrames = false;
+        vlcProducer->waitForRoom( vlcProducer->m_audioChunks, vlcProducer->m_audioReadAhead,
+                                  vlcProducer->m_videoStarving );
+        vlcProducer->m_audioGeneration = vlcProducer->m_seekGeneration;
 
-        vlcProducer->m_audioTooManyFramesCond.wait( lck, [vlcProducer]{
-            return vlcProducer->m_isAudioTooManyFrames == false ||
-                    vlcProducer->m_audioStopping == true;
-        });
-
-        *buffer = ( uint8_t* ) mlt_pool_alloc( size * sizeof( uint8_t ) );
+        // smem writes the samples straight into the ring. If they don't fit
+        // they are decoded somewhere else and dropped.
+        auto& ring = vlcProducer->m_audioRing;
+        *buffer = nullptr;
+        if ( ring.frameBytes() != 0 && size % ring.frameBytes() == 0 )
+            *buffer = ring.writePointer( size / ring.frameBytes() );
+        if ( *buffer == nullptr )
+        {
+            vlcProducer->m_audioScratch.resize( size );
+            *buffer = vlcProducer->m_audioScratch.data();
+        }
+        vlcProducer->m_audioWriting = *buffer;
     }
 
     static void audio_unlock( void* data, uint8_t* buffer, unsigned int channels,
@@ -325,182 +1140,635 @@ private:
                               size_t size, int64_t pts )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( data );
+        vlcProducer->calibrate( pts );
+
+        // Drop what was decoded before the seek target. Chunks from before
+        // the seek are dropped by the consumer anyway.
+        const int64_t target = vlcProducer->m_audioGeneration == vlcProducer->m_seekGeneration ?
+                               vlcProducer->m_audioSeekSample.load() : -1;
+        const int64_t first = vlcProducer->sampleAt( pts, rate );
+        if ( target >= 0 && rate > 0 && first + nb_samples <= target )
+            return;
 
-        auto frame = std::make_shared<Frame>();
-        frame->buffer = buffer;
-        frame->size = size;
-        frame->iterator = 0;
+        // The chunk queue is only full if we stopped waiting because video is
+        // starving.
+        // A dropped chunk still takes its place, get_audio plays silence
+        // instead. Before the first chunk after a seek nothing is placed yet.
+        auto& ring = vlcProducer->m_audioRing;
+        if ( buffer != vlcProducer->m_audioWriting || buffer == vlcProducer->m_audioScratch.data() ||
+             size != nb_samples * ring.frameBytes() || vlcProducer->m_audioChunks.full() == true )
+        {
+            if ( target < 0 )
+                vlcProducer->m_audioNextSample += nb_samples;
+            return;
+        }
 
-        std::unique_lock<std::mutex> lck( vlcProducer->m_audioLock );
-        vlcProducer->m_audioFramesTotalSize += size;
-        vlcProducer->m_audioFrames.push_back( frame );
-        vlcProducer->m_isAudioFrameReady = true;
-        vlcProducer->m_audioFrameReadyCond.notify_all();
+        // The first chunk after a seek is placed by its timestamp, trimmed to
+        // start at the target at the earliest. get_audio pads what precedes
+        // it with silence. Later ones follow it.
+        int64_t sample = vlcProducer->m_audioNextSample;
+        if ( target >= 0 && rate > 0 )
+        {
+            sample = first;
+            if ( first < target )
+            {
+                const size_t trim = target - first;
+                nb_samples -= trim;
+                memmove( buffer, buffer + trim * ring.frameBytes(), nb_samples * ring.frameBytes() );
+                size = nb_samples * ring.frameBytes();
+                sample = target;
+            }
+            vlcProducer->m_audioSeekSample = -1;
+        }
+        vlcProducer->m_audioNextSample = sample + nb_samples;
+
+        AudioChunk& chunk = vlcProducer->m_audioChunks.next();
+        chunk.position = ring.writePosition();
+        chunk.sample = sample;
+        chunk.samples = nb_samples;
+        chunk.generation = vlcProducer->m_audioGeneration;
+        vlcProducer->m_audioChunks.push();
+        ring.commit( nb_samples );
+        vlcProducer->m_audioHead = sample + nb_samples;
+        vlcProducer->m_audioHeadGeneration = chunk.generation;
+        vlcProducer->m_audioChunks.produced().wake();
+        vlcProducer->m_audioReadAhead.decoded( size );
     }
 
     static void video_lock( void* data, uint8_t** buffer, size_t size )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( data );
-        std::unique_lock<std::mutex> lck( vlcProducer->m_videoLock );
 
-        if ( vlcProducer->m_videoFrames.size() >= vlcProducer->m_videoBufferLimit )
-            vlcProducer->m_isVideoTooManyFrames = true;
-        else
-            vlcProducer->m_isVideoTooManyFrames = false;
+        vlcProducer->waitForRoom( vlcProducer->m_videoFrames, vlcProducer->m_videoReadAhead,
+                                  vlcProducer->m_audioStarving );
+        vlcProducer->m_videoGeneration = vlcProducer->m_seekGeneration;
 
-        vlcProducer->m_videoTooManyFramesCond.wait( lck, [vlcProducer]{
-            return vlcProducer->m_isVideoTooManyFrames == false ||
-                    vlcProducer->m_videoStopping == true;
-        });
-
-        *buffer = ( uint8_t* ) mlt_pool_alloc( size * sizeof( uint8_t ) );
+        *buffer = FrameBuffer::alloc( size * sizeof( uint8_t ) );
     }
 
     static void video_unlock( void* data, uint8_t* buffer, int width, int height,
                               int bpp, size_t size, int64_t pts )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( data );
+        vlcProducer->calibrate( pts );
+
+        int64_t target = vlcProducer->m_videoSeekTarget;
+        if ( target >= 0 )
+        {
+            if ( vlcProducer->mediaTime( pts ) + vlcProducer->m_frameDuration / 2 <= target )
+            {
+                FrameBuffer::release( buffer );
+                return;
+            }
+            vlcProducer->m_videoSeekTarget = -1;
+        }
 
-        auto frame = std::make_shared<Frame>();
-        frame->buffer = buffer;
-        frame->size = size;
+        if ( vlcProducer->m_videoFrames.full() == true )
+        {
+            FrameBuffer::release( buffer );
+            vlcProducer->m_framesSkipped.add();
+            return;
+        }
 
-        std::unique_lock<std::mutex> lck( vlcProducer->m_videoLock );
-        vlcProducer->m_videoFrames.push_back( frame );
-        vlcProducer->m_isVideoFrameReady = true;
-        vlcProducer->m_videoFrameReadyCond.notify_all();
+        Frame& videoFrame = vlcProducer->m_videoFrames.next();
+        videoFrame.buffer = buffer;
+        videoFrame.size = size;
+        videoFrame.width = width;
+        videoFrame.height = height;
+        videoFrame.pts = pts;
+        videoFrame.generation = vlcProducer->m_videoGeneration;
+        videoFrame.first = videoFrame.generation != vlcProducer->m_videoQueuedGeneration;
+        vlcProducer->m_videoQueuedGeneration = videoFrame.generation;
+        vlcProducer->m_videoFrames.push();
+        vlcProducer->m_videoHead = vlcProducer->mediaTime( pts );
+        vlcProducer->m_videoReadAhead.decoded( size );
     }
 
     static void producer_close( mlt_producer parent )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( parent->child );
         vlcProducer->producer()->close = nullptr;
-        vlcProducer->stop();
+        vlcProducer->cancelOpen();
+        // A pipeline still running can serve the next producer of the same
+        // resource. One evicted from the service cache is really closed.
+        vlcProducer->m_parking = vlcProducer->isValid() == true && vlcProducer->m_stopping == false;
+        if ( vlcProducer->m_parking == false )
+            vlcProducer->stop();
         mlt_service_cache_purge( vlcProducer->m_parent->get_service() );
     }
 
     static void vlc_producer_close( VLCProducer* parent )
     {
-        delete parent;
+        if ( parent->m_parking == true )
+            parent->park();
+        else
+            delete parent;
+    }
+
+    int64_t positionToTime( mlt_position position )
+    {
+        return ( int64_t ) ( ( double ) position / m_parent->get_fps() * 1000000.0 + 0.5 );
+    }
+
+    // The keyframe index if keyframe_index is set, looked up on first use.
+    // Starting its pass sets up a player, so neither queue lock may be held.
+    std::shared_ptr<KeyframeIndex> keyframeIndex()
+    {
+        {
+            std::lock_guard<std::mutex> lck( m_videoLock );
+            if ( m_keyframeIndex != nullptr || m_parent->get_int( "keyframe_index" ) == 0 )
+                return m_keyframeIndex;
+        }
+        auto index = KeyframeIndex::get( m_resource, m_videoCodec, m_instance );
+
+        std::lock( m_videoLock, m_audioLock );
+        std::lock_guard<std::mutex> videoLck( m_videoLock, std::adopt_lock );
+        std::lock_guard<std::mutex> audioLck( m_audioLock, std::adopt_lock );
+        if ( m_keyframeIndex == nullptr )
+            m_keyframeIndex = index;
+        return m_keyframeIndex;
+    }
+
+    // Returns the index of the buffered frame shown at media time `target` among
+    // the first `count`, -1 if the target precedes them, or `count` if it
+    // follows them. m_videoLock must be held.
+    int findVideoFrame( int64_t target, int count )
+    {
+        if ( count == 0 )
+            return 0;
+
+        // Video may start after the origin, which may come from audio. If the
+        // decoder started at or before the target, seeking again wouldn't
+        // bring anything earlier than its first frame.
+        const int64_t half = m_frameDuration / 2;
+        if ( target + half < mediaTime( m_videoFrames.front().pts ) )
+            return m_videoFrames.front().first == true && positionToTime( m_seekPosition ) <= target ? 0 : -1;
+        if ( target >= mediaTime( m_videoFrames[count - 1].pts ) + half )
+            return count;
+
+        // Last frame starting at or before the target.
+        int low = 0, high = count - 1;
+        while ( low < high )
+        {
+            int middle = ( low + high + 1 ) / 2;
+            if ( mediaTime( m_videoFrames[middle].pts ) <= target + half )
+                low = middle;
+            else
+                high = middle - 1;
+        }
+        return low;
+    }
+
+    // Whether the decoder will reach `target` soon enough that waiting is
+    // cheaper than a seek. m_videoLock must be held.
+    bool isVideoAhead( int64_t target )
+    {
+        const int64_t head = m_videoHead;
+        if ( target < head )
+            return false;
+        const int64_t window = std::max<int64_t>( m_videoReadAhead.depth(), 12 ) * m_frameDuration;
+        if ( target - head <= window )
+            return true;
+
+        // A seek would restart decoding from the keyframe preceding the target
+        // anyway, so if the decoder is already past it keep decoding.
+        if ( m_keyframeIndex != nullptr )
+        {
+            int64_t keyframe = m_keyframeIndex->keyframeBefore( target );
+            return keyframe >= 0 && keyframe <= head;
+        }
+        return false;
+    }
+
+    // Whether media sample `start` is still to come and the decoder will reach
+    // it soon enough that decoding through is cheaper than a seek. m_audioLock
+    // must be held.
+    bool isAudioAhead( int64_t start )
+    {
+        if ( start < m_audioCursor )
+            return false;
+        const int64_t rate = m_parent->get_int( "sample_rate" );
+        const int64_t head = std::max( audioHead(), m_audioCursor );
+        const int64_t window = std::max<int64_t>( m_videoReadAhead.depth(), 12 ) * m_frameDuration * rate / 1000000;
+        if ( start - head <= window )
+            return true;
+
+        if ( m_keyframeIndex != nullptr && rate > 0 )
+        {
+            int64_t keyframe = m_keyframeIndex->keyframeBefore( start * 1000000 / rate );
+            return keyframe >= 0 && keyframe * rate / 1000000 <= head;
+        }
+        return false;
     }
 
     static int producer_get_image( mlt_frame frame, uint8_t** buffer,
                                    mlt_image_format* format, int* width, int* height, int writable )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( mlt_frame_pop_service( frame ) );
-
-        if ( vlcProducer->m_videoFrames.size() > 0 )
-            vlcProducer->m_isVideoFrameReady = true;
+        vlcProducer->waitOpened();
+        if ( vlcProducer->playerValid() == false )
+            return 1;
+
+        const mlt_position position = mlt_frame_original_position( frame );
+        const int64_t target = vlcProducer->positionToTime( position );
+        const double speed = mlt_properties_get_double( MLT_FRAME_PROPERTIES( frame ), "_speed" );
+        const auto posDiff = vlcProducer->m_videoExpected - position;
+        size_t size = 0;
+        mlt_destructor destructor = mlt_pool_release;
+
+        // Decode straight to the format and size the consumer asks for, so
+        // that neither VLC nor MLT has to convert. Switching means rebuilding
+        // the chain, so only do it before the first image or once the new
+        // request is settled.
+        bool rebuild = false;
+        mlt_image_format imageFormat = vlcChroma( *format ) != nullptr ? *format : vlcProducer->m_imageFormat;
+        int decodeWidth;
+        int decodeHeight;
+        vlcProducer->decodeSize( *width, *height, &decodeWidth, &decodeHeight );
+        if ( imageFormat != vlcProducer->m_imageFormat || decodeWidth != vlcProducer->m_decodeWidth ||
+             decodeHeight != vlcProducer->m_decodeHeight )
+        {
+            if ( vlcProducer->m_imageShown == false ||
+                 ++vlcProducer->m_formatRequests >= FormatSwitchRequests )
+            {
+                vlcProducer->m_imageFormat = imageFormat;
+                vlcProducer->m_decodeWidth = decodeWidth;
+                vlcProducer->m_decodeHeight = decodeHeight;
+                vlcProducer->m_formatRequests = 0;
+                rebuild = true;
+            }
+        }
         else
+            vlcProducer->m_formatRequests = 0;
+        // Decoder options are per media too. This also catches a leased
+        // pipeline that was built with other settings.
+        if ( vlcProducer->decoderOptions() != vlcProducer->m_decoderOptions )
+            rebuild = true;
+        if ( rebuild == true )
         {
-            vlcProducer->m_isVideoFrameReady = false;
-            vlcProducer->m_videoBufferLimit++;
+            std::lock_guard<std::mutex> playerLck( vlcProducer->m_playerLock );
+            vlcProducer->restart( position );
         }
 
+        *format = vlcProducer->m_imageFormat;
+        *width = vlcProducer->m_decodeWidth > 0 ? vlcProducer->m_decodeWidth : vlcProducer->m_parent->get_int( "width" );
+        *height = vlcProducer->m_decodeHeight > 0 ? vlcProducer->m_decodeHeight : vlcProducer->m_parent->get_int( "height" );
+        *buffer = nullptr;
+
+        // Images shown before don't need VLC at all.
+        FrameCache* cache = vlcProducer->frameCache();
+        FrameCache::Key key;
+        if ( cache != nullptr )
+        {
+            key = vlcProducer->cacheKey( target, *width, *height );
+            *buffer = cache->get( key, &size );
+            vlcProducer->m_parent->set( *buffer != nullptr ? "cache.hits" : "cache.misses",
+                                        *buffer != nullptr ? ++vlcProducer->m_cacheHits : ++vlcProducer->m_cacheMisses );
+            vlcProducer->m_parent->set( "cache.bytes", cache->bytes() );
+            if ( *buffer != nullptr )
+                return vlcProducer->setImage( frame, buffer, size, FrameBuffer::release, *width, *height,
+                                              writable, position );
+        }
+
+        vlcProducer->setRate( speed );
+        if ( speed < 0 )
+            return vlcProducer->reverseImage( frame, buffer, position, target, width, height, writable, cache, key );
+        vlcProducer->clearReverse();
+        vlcProducer->resume();
+
+        vlcProducer->keyframeIndex();
+
         std::unique_lock<std::mutex> lck( vlcProducer->m_videoLock );
 
-        if ( vlcProducer->m_videoMediaPlayer.isPlaying() == false )
-            vlcProducer->m_videoMediaPlayer.play();
+        auto& frames = vlcProducer->m_videoFrames;
+        vlcProducer->dropStaleVideo();
+        int count = frames.size();
+        int index = vlcProducer->findVideoFrame( target, count );
+        // Past the end there is nothing to seek to.
+        const bool pastEnd = vlcProducer->m_decoderState == Ended && target >= vlcProducer->m_videoHead;
+        bool toSeek = pastEnd == false &&
+                      ( index < 0 || ( index == count && vlcProducer->isVideoAhead( target ) == false ) );
+        // Seek
+        if ( toSeek == true )
+        {
+            lck.unlock();
+            if ( vlcProducer->seek( position ) == true )
+                vlcProducer->m_parent->set( "stats.seeks", ++vlcProducer->m_seekCount );
+            lck.lock();
+        }
+        else if ( posDiff > 1 || posDiff <= -12 )
+            vlcProducer->m_parent->set( "stats.seeks_avoided", ++vlcProducer->m_seekAvoidedCount );
 
-        vlcProducer->m_videoFrameReadyCond.wait_for( lck, std::chrono::milliseconds( 1000 ),
-                                    [vlcProducer]{ return vlcProducer->m_isVideoFrameReady; } );
+        const auto deadline = vlcProducer->waitDeadline( vlcProducer->hasLastImage() );
+        bool underrun = false;
+        for ( ;; )
+        {
+            vlcProducer->dropStaleVideo();
+            count = frames.size();
+            index = vlcProducer->findVideoFrame( target, count );
+            if ( index != count || vlcProducer->m_stopping == true )
+                break;
+
+            // Everything buffered precedes the target, so make room for the decoder.
+            frames.pop( count );
+            vlcProducer->m_framesSkipped.add( count );
+            underrun = true;
+            vlcProducer->m_videoStarving = true;
+            vlcProducer->m_audioChunks.consumed().wake();
+
+            uint32_t seq = frames.produced().value();
+            if ( frames.empty() == false )
+                continue;
+            if ( vlcProducer->waitProduced( frames, seq, deadline, vlcProducer->m_videoWait ) == false )
+                break;
+        }
+        vlcProducer->m_videoStarving = false;
+        vlcProducer->publishState( index < 0 || index == count );
+        if ( toSeek == false )
+            vlcProducer->pulled( vlcProducer->m_videoReadAhead, "video", 1, underrun,
+                                 vlcProducer->m_videoReadAhead.bytes( frames.size() ),
+                                 vlcProducer->audioBytes() );
+
+        if ( index >= 0 && index < count )
+        {
+            // Frames before the one shown won't be needed when playing forward.
+            frames.pop( index );
+            vlcProducer->m_framesSkipped.add( index );
+
+            Frame& videoFrame = frames.front();
+            if ( videoFrame.pts == vlcProducer->m_lastShownPts )
+                vlcProducer->m_framesRepeated.add();
+            vlcProducer->m_lastShownPts = videoFrame.pts;
+            size = videoFrame.size;
+            *width = videoFrame.width;
+            *height = videoFrame.height;
+            vlcProducer->m_imageShown = true;
+
+            // Keep the frame if the next position will show it again (pause,
+            // slow motion or a source slower than the profile) and share its
+            // buffer, otherwise hand the buffer over.
+            const int64_t next = vlcProducer->positionToTime( position + 1 );
+            if ( speed <= 0 || vlcProducer->mediaTime( videoFrame.pts ) + vlcProducer->m_frameDuration / 2 > next )
+                *buffer = FrameBuffer::ref( videoFrame.buffer );
+            else
+            {
+                *buffer = videoFrame.buffer;
+                videoFrame.buffer = nullptr;
+                frames.pop();
+            }
+            destructor = FrameBuffer::release;
 
-        if ( vlcProducer->m_videoFrames.size() >= vlcProducer->m_videoBufferLimit )
-            vlcProducer->m_isVideoTooManyFrames = true;
+            // A cached image is shared, so one to be written to would have to
+            // be copied.
+            if ( cache != nullptr && writable == 0 && *width == key.width && *height == key.height )
+                cache->put( key, *buffer, size );
+        }
         else
-            vlcProducer->m_isVideoTooManyFrames = false;
-        vlcProducer->m_videoTooManyFramesCond.notify_all();
+        {
+            // Nothing decoded in time: show the last image rather than a blank
+            // one.
+            *buffer = vlcProducer->lastImage( &size, width, height );
+            if ( *buffer != nullptr )
+                destructor = FrameBuffer::release;
+        }
 
-        *format = mlt_image_yuv422;
-        *width = vlcProducer->m_parent->get_int( "width" );
-        *height = vlcProducer->m_parent->get_int( "height" );
-        *buffer = nullptr;
+        return vlcProducer->setImage( frame, buffer, size, destructor, *width, *height, writable, position );
+    }
 
-        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "format", mlt_image_yuv422 );
-        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ),"width", vlcProducer->m_parent->get_int( "width" ) );
-        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ),"height", vlcProducer->m_parent->get_int( "height" ) );
+    // Fast-forward is passed on to VLC, so decoding keeps up with the pace
+    // frames are needed at.
+    void setRate( double speed )
+    {
+        const float rate = speed > 1 ? speed : 1;
+        std::lock_guard<std::mutex> lck( m_playerLock );
+        if ( rate != m_rate )
+        {
+            m_mediaPlayer.setRate( rate );
+            m_rate = rate;
+        }
+    }
 
-        vlcProducer->m_videoLastPosition = mlt_frame_original_position( frame );
+    // Reverse playback. Seeking back for every frame is far too slow, so the
+    // stretch of media up to `target` is decoded forward into
+    // m_reverseFrames once and then served back to front.
+    int reverseImage( mlt_frame frame, uint8_t** buffer, mlt_position position, int64_t target,
+                      int* width, int* height, int writable, FrameCache* cache, const FrameCache::Key& key )
+    {
+        std::lock_guard<std::mutex> reverseLck( m_reverseLock );
+        int index = findReverseFrame( target );
+        if ( index < 0 )
+        {
+            fillReverse( position, target );
+            index = findReverseFrame( target );
+        }
 
-        double fps = vlcProducer->m_parent->get_fps();
-        if ( mlt_properties_get( MLT_FRAME_PROPERTIES( frame ), "producer_consumer_fps" ) )
-            fps = mlt_properties_get_double( MLT_FRAME_PROPERTIES(frame), "producer_consumer_fps" );
-        const auto posDiff = vlcProducer->m_videoExpected - vlcProducer->m_videoLastPosition;
-        const auto frameDiff = fps / vlcProducer->m_parent->get_double( "frame_rate" ); // Theoretical fps in the actual vlc
-        bool toSeek = posDiff > 1 || posDiff <= -12;
         size_t size = 0;
-        // Seek
-        if ( toSeek == true )
+        mlt_destructor destructor = mlt_pool_release;
+        if ( index >= 0 )
         {
-            vlcProducer->m_videoFrames.clear();
-            vlcProducer->m_videoMediaPlayer.setPosition( ( double ) vlcProducer->m_videoLastPosition / vlcProducer->m_parent->get_length() );
-            vlcProducer->m_videoLastPositionReal = vlcProducer->m_videoLastPosition + 1;
+            // What follows has been shown already.
+            while ( ( int ) m_reverseFrames.size() > index + 1 )
+                m_reverseFrames.pop_back();
+
+            Frame& reverseFrame = m_reverseFrames.back();
+            *buffer = FrameBuffer::ref( reverseFrame.buffer );
+            size = reverseFrame.size;
+            *width = reverseFrame.width;
+            *height = reverseFrame.height;
+            destructor = FrameBuffer::release;
+            m_imageShown = true;
+
+            if ( cache != nullptr && writable == 0 && *width == key.width && *height == key.height )
+                cache->put( key, *buffer, size );
         }
-        else
+        return setImage( frame, buffer, size, destructor, *width, *height, writable, position );
+    }
+
+    // Index of the frame of m_reverseFrames shown at media time `target`, -1
+    // if they don't cover it. m_reverseLock must be held.
+    int findReverseFrame( int64_t target )
+    {
+        const int64_t half = m_frameDuration / 2;
+        for ( int i = ( int ) m_reverseFrames.size() - 1; i >= 0; i-- )
+        {
+            const int64_t time = mediaTime( m_reverseFrames[i].pts );
+            if ( time <= target + half )
+                return i + 1 < ( int ) m_reverseFrames.size() || target < time + half ? i : -1;
+        }
+        return -1;
+    }
+
+    // Decodes the frames from at most reverse_window frames before `target`
+    // up to the one shown at `target`. With a keyframe index, decoding starts
+    // at the GOP of the target instead, if that's closer. m_reverseLock must
+    // be held.
+    void fillReverse( mlt_position position, int64_t target )
+    {
+        m_reverseFrames.clear();
+
+        const int window = std::max( m_parent->get_int( "reverse_window" ), 1 );
+        mlt_position start = std::max( position - window + 1, 0 );
+        const auto keyframeIndex = this->keyframeIndex();
+        if ( keyframeIndex != nullptr )
         {
-            bool paused = posDiff == 1;
-            if ( toSeek == false && paused == false )
-                vlcProducer->m_videoLastPositionReal -= posDiff;
-            bool toDuplicate = vlcProducer->m_videoLastPositionReal - vlcProducer->m_videoLastPosition > 1;
-            bool toSkip = vlcProducer->m_videoLastPositionReal - vlcProducer->m_videoLastPosition < -1;
+            const int64_t keyframe = keyframeIndex->keyframeBefore( target );
+            if ( keyframe >= 0 )
+                start = std::max( start, ( mlt_position ) ( ( double ) keyframe * m_parent->get_fps() / 1000000.0 + 0.5 ) );
+        }
 
-            while ( toSkip == true )
+        resume();
+        if ( seek( start ) == true )
+            m_parent->set( "stats.seeks", ++m_seekCount );
+
+        const int64_t half = m_frameDuration / 2;
+        auto& frames = m_videoFrames;
+        std::unique_lock<std::mutex> lck( m_videoLock );
+        m_videoStarving = true;
+        m_audioChunks.consumed().wake();
+        bool reached = false;
+        while ( reached == false && m_stopping == false )
+        {
+            uint32_t seq = frames.produced().value();
+            dropStaleVideo();
+            while ( frames.empty() == false && reached == false )
             {
-                if ( vlcProducer->m_videoFrames.size() > 0 )
-                {
-                    vlcProducer->m_videoFrames.pop_front();
-                    vlcProducer->m_videoLastPositionReal += frameDiff;
-                    toSkip = vlcProducer->m_videoLastPositionReal - vlcProducer->m_videoLastPosition < -1;
-                }
-                else
+                Frame& videoFrame = frames.front();
+                const int64_t time = mediaTime( videoFrame.pts );
+                if ( time > target + half )
                 {
-                    toSeek = true;
+                    reached = true;
                     break;
                 }
+                m_reverseFrames.emplace_back();
+                Frame& reverseFrame = m_reverseFrames.back();
+                reverseFrame.buffer = videoFrame.buffer;
+                reverseFrame.size = videoFrame.size;
+                reverseFrame.width = videoFrame.width;
+                reverseFrame.height = videoFrame.height;
+                reverseFrame.pts = videoFrame.pts;
+                videoFrame.buffer = nullptr;
+                frames.pop();
+                reached = time >= target - half;
             }
+            if ( reached == false && waitProduced( frames, seq, waitDeadline( false ), m_videoWait ) == false )
+                break;
+        }
+        m_videoStarving = false;
+    }
 
-            if ( vlcProducer->m_videoFrames.size() > 0 )
-            {
-                auto videoFrame = vlcProducer->m_videoFrames.front();
-                size = videoFrame->size;
+    void clearReverse()
+    {
+        std::lock_guard<std::mutex> reverseLck( m_reverseLock );
+        m_reverseFrames.clear();
+    }
 
-                if ( paused == true || toDuplicate == true )
-                {
-                    *buffer = ( uint8_t* ) mlt_pool_alloc( videoFrame->size );
-                    memcpy( *buffer, videoFrame->buffer, size );
-                    if ( toDuplicate == true )
-                        vlcProducer->m_videoLastPositionReal -= frameDiff;
-                }
-                else
-                {
-                    *buffer = videoFrame->buffer;
-                    videoFrame->buffer = nullptr;
-                    vlcProducer->m_videoFrames.pop_front();
-                }
-            }
+    // Hands `*buffer` over to `frame`, or a blank image if it's nullptr.
+    int setImage( mlt_frame frame, uint8_t** buffer, size_t size, mlt_destructor destructor,
+                  int width, int height, int writable, mlt_position position )
+    {
+        // Only a buffer nobody else sees may be written to.
+        if ( *buffer != nullptr && destructor == FrameBuffer::release && writable != 0 &&
+             FrameBuffer::refCount( *buffer ) > 1 )
+        {
+            auto copy = ( uint8_t* ) mlt_pool_alloc( size );
+            memcpy( copy, *buffer, size );
+            FrameBuffer::release( *buffer );
+            *buffer = copy;
+            destructor = mlt_pool_release;
         }
+        // An image that may be written to is no good to show again.
+        else if ( *buffer != nullptr && destructor == FrameBuffer::release && writable == 0 )
+            rememberImage( *buffer, size, width, height );
 
         if ( *buffer == nullptr )
-            *buffer = ( uint8_t* ) mlt_pool_alloc( mlt_image_format_size( mlt_image_yuv422, *width, *height, NULL ) );
+            *buffer = ( uint8_t* ) mlt_pool_alloc( mlt_image_format_size( m_imageFormat, width, height, NULL ) );
+
+        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "format", m_imageFormat );
+        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "width", width );
+        mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "height", height );
 
-        mlt_frame_set_image( frame, *buffer, size,
-                             ( mlt_destructor ) mlt_pool_release );
+        mlt_frame_set_image( frame, *buffer, size, destructor );
 
-        vlcProducer->m_videoExpected = vlcProducer->m_videoLastPosition + 1;
-        vlcProducer->m_videoLastPositionReal += frameDiff;
+        m_videoExpected = position + 1;
+        publishStats();
 
         return 0;
     }
 
+    // The cache to look images up in, nullptr if caching is off.
+    FrameCache* frameCache()
+    {
+        if ( m_parent->get_int( "cache.global" ) != 0 )
+            return &FrameCache::global();
+        const int64_t budget = m_parent->get_int64( "cache.budget" );
+        if ( budget <= 0 )
+            return nullptr;
+        if ( m_frameCache == nullptr )
+            m_frameCache.reset( new FrameCache( budget ) );
+        else
+            m_frameCache->setBudget( budget );
+        return m_frameCache.get();
+    }
+
+    // Images differ by decoder options too, so a preview never ends up in a
+    // final render.
+    FrameCache::Key cacheKey( int64_t time, int width, int height )
+    {
+        FrameCache::Key key;
+        key.source = m_resource;
+        for ( const auto& option : m_decoderOptions )
+            key.source += " " + option;
+        key.time = time;
+        key.format = m_imageFormat;
+        key.width = width;
+        key.height = height;
+        return key;
+    }
+
     static int producer_get_audio( mlt_frame frame, void** buffer, mlt_audio_format* format,
                                    int* frequency, int* channels, int* samples )
     {
         auto vlcProducer = reinterpret_cast<VLCProducer*>( mlt_frame_pop_audio( frame ) );
+        vlcProducer->waitOpened();
+        if ( vlcProducer->playerValid() == false )
+            return 1;
 
         double fps = vlcProducer->m_parent->get_fps();
         if ( mlt_properties_get( MLT_FRAME_PROPERTIES( frame ), "producer_consumer_fps" ) )
             fps = mlt_properties_get_double( MLT_FRAME_PROPERTIES(frame), "producer_consumer_fps" );
 
+        vlcProducer->m_audioLastPosition = mlt_frame_original_position( frame );
+
+        // Shuttling is silent, and must not seek: the video side follows the
+        // playhead on its own.
+        const double speed = mlt_properties_get_double( MLT_FRAME_PROPERTIES( frame ), "_speed" );
+        const bool shuttling = speed < 0 || speed > 1;
+
+        auto posDiff = vlcProducer->m_audioExpected - vlcProducer->m_audioLastPosition;
+        // The samples of this position, whatever was handed out before: a
+        // frame that got silence because the decoder was late doesn't delay
+        // the ones after it.
+        const int64_t start = vlcProducer->audioSampleAt( vlcProducer->m_audioLastPosition );
+        // Seek when the samples were consumed already or are too far ahead to
+        // decode through; anything closer is trimmed or padded by readAudio().
+        // Back at normal speed, seek to line the audio up again.
+        // Past the end there is nothing to seek to.
+        const bool pastEnd = vlcProducer->m_decoderState == Ended &&
+                             vlcProducer->positionToTime( vlcProducer->m_audioLastPosition ) >= vlcProducer->m_videoHead;
+        bool toSeek = false;
+        if ( shuttling == false && pastEnd == false )
+        {
+            std::lock_guard<std::mutex> lck( vlcProducer->m_audioLock );
+            vlcProducer->dropStaleAudio();
+            toSeek = vlcProducer->m_audioShuttled == true ||
+                     ( posDiff != 1 && vlcProducer->isAudioAhead( start ) == false );
+        }
+        vlcProducer->m_audioShuttled = shuttling;
+
+        // Seek
+        if ( toSeek == true )
+            vlcProducer->seek( vlcProducer->m_audioLastPosition );
+
         int needed_samples = mlt_sample_calculator(
             fps,
             vlcProducer->m_parent->get_int64( "sample_rate" ),
@@ -509,32 +1777,46 @@ private:
         unsigned int audio_buffer_size = mlt_audio_format_size( mlt_audio_s16, needed_samples,
                                                                 vlcProducer->m_parent->get_int64( "channels" ) );
 
-        if ( vlcProducer->m_audioFramesTotalSize >= audio_buffer_size )
-            vlcProducer->m_isAudioFrameReady = true;
-        else
-        {
-            vlcProducer->m_isAudioFrameReady = false;
-            vlcProducer->m_audioBufferLimit++;
-        }
+        bool paused = shuttling == true || ( toSeek == false && posDiff == 1 );
 
+        vlcProducer->resume();
         std::unique_lock<std::mutex> lck( vlcProducer->m_audioLock );
 
-        if ( vlcProducer->m_audioMediaPlayer.isPlaying() == false )
-            vlcProducer->m_audioMediaPlayer.play();
+        // What gets decoded while shuttling is of no use. Drop it so the
+        // decoder doesn't stall on it.
+        if ( shuttling == true )
+        {
+            vlcProducer->dropStaleAudio();
+            vlcProducer->popAudio( vlcProducer->m_audioRing.size() );
+            vlcProducer->m_audioChunks.consumed().wake();
+        }
 
-        vlcProducer->m_audioFrameReadyCond.wait_for( lck, std::chrono::milliseconds( 1000 ),
-                                    [vlcProducer]{ return vlcProducer->m_isAudioFrameReady; } );
+        auto& chunks = vlcProducer->m_audioChunks;
+        auto& ring = vlcProducer->m_audioRing;
+        const size_t wanted = ring.frameBytes() != 0 ? needed_samples : 0;
+        vlcProducer->dropStaleAudio();
+        const bool underrun = paused == false && vlcProducer->audioHead() < start + ( int64_t ) wanted;
+        if ( underrun == true )
+        {
+            vlcProducer->m_audioStarving = true;
+            vlcProducer->m_videoFrames.consumed().wake();
 
-        if ( vlcProducer->m_audioFrames.size() >= vlcProducer->m_audioBufferLimit )
-            vlcProducer->m_isAudioTooManyFrames = true;
-        else
-            vlcProducer->m_isAudioTooManyFrames = false;
-        vlcProducer->m_audioTooManyFramesCond.notify_all();
+            // Silence is what there is to play while the decoder is late.
+            const auto deadline = vlcProducer->waitDeadline( vlcProducer->m_imageShown );
+            while ( vlcProducer->m_stopping == false )
+            {
+                uint32_t seq = chunks.produced().value();
+                vlcProducer->dropStaleAudio();
+                if ( vlcProducer->audioHead() >= start + ( int64_t ) wanted )
+                    break;
+                if ( vlcProducer->waitProduced( chunks, seq, deadline, vlcProducer->m_audioWait ) == false )
+                    break;
+            }
+            vlcProducer->m_audioStarving = false;
+        }
 
         auto packedAudioBuffer = ( uint8_t* ) mlt_pool_alloc( audio_buffer_size );
-        vlcProducer->m_audioLastPosition = mlt_frame_original_position( frame );
-        auto posDiff = vlcProducer->m_audioExpected - vlcProducer->m_audioLastPosition;
-        bool toSeek = posDiff > 1 || posDiff <= -12;
+        memset( packedAudioBuffer, 0, audio_buffer_size );
 
         *buffer = packedAudioBuffer;
         *frequency = vlcProducer->m_parent->get_int64( "sample_rate" );
@@ -549,45 +1831,22 @@ private:
         mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "audio_samples", needed_samples );
         mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "audio_format", mlt_audio_s16 );
 
-        // Seek
-        if ( toSeek == true )
+        if ( paused == false && wanted > 0 && audio_buffer_size == wanted * ring.frameBytes() )
+            vlcProducer->readAudio( packedAudioBuffer, start, wanted );
+
+        if ( toSeek == false && paused == false && wanted > 0 )
         {
-            vlcProducer->m_audioFrames.clear();
-            vlcProducer->m_audioFramesTotalSize = 0;
-            vlcProducer->m_audioMediaPlayer.setPosition( ( double ) vlcProducer->m_audioLastPosition / vlcProducer->m_parent->get_length() );
+            const size_t chunkSamples = chunks.empty() == false ? chunks.front().samples : wanted;
+            vlcProducer->pulled( vlcProducer->m_audioReadAhead, "audio", ( double ) wanted / chunkSamples,
+                                 underrun, vlcProducer->audioBytes(),
+                                 vlcProducer->m_videoReadAhead.bytes( vlcProducer->m_videoFrames.size() ) );
         }
-        else
-        {
-            bool paused = posDiff == 1;
-            if ( paused == false && vlcProducer->m_audioFramesTotalSize >= audio_buffer_size )
-            {
-                unsigned  iterator = 0;
-                while ( iterator < audio_buffer_size )
-                {
-                    auto frontBuffer = vlcProducer->m_audioFrames.front();
-
-                    if ( audio_buffer_size - iterator >= frontBuffer->size - frontBuffer->iterator  )
-                    {
-                        memcpy( packedAudioBuffer + iterator, frontBuffer->buffer + frontBuffer->iterator, frontBuffer->size - frontBuffer->iterator );
-                        iterator += frontBuffer->size - frontBuffer->iterator;
-                        vlcProducer->m_audioFramesTotalSize -= frontBuffer->size - frontBuffer->iterator;
-                        vlcProducer->m_audioFrames.pop_front();
-                    }
-                    else
-                    {
-                        memcpy( packedAudioBuffer + iterator, frontBuffer->buffer + frontBuffer->iterator, audio_buffer_size - iterator );
-                        frontBuffer->iterator += audio_buffer_size - iterator;
-                        vlcProducer->m_audioFramesTotalSize -= audio_buffer_size - iterator;
-                        iterator = audio_buffer_size;
-                    }
-                }
-            }
 
-            mlt_frame_set_audio( frame, packedAudioBuffer, mlt_audio_s16,
-                                 audio_buffer_size, ( mlt_destructor ) mlt_pool_release );
-        }
+        mlt_frame_set_audio( frame, packedAudioBuffer, mlt_audio_s16,
+                             audio_buffer_size, ( mlt_destructor ) mlt_pool_release );
 
         vlcProducer->m_audioExpected = vlcProducer->m_audioLastPosition + 1;
+        vlcProducer->publishStats();
 
         return 0;
     }
@@ -622,48 +1881,128 @@ private:
         return 0;
     }
 
-    std::unique_ptr<Mlt::Producer>      m_parent;
-
+    std::unique_ptr<Mlt::Producer>      m_parent;     // nullptr while parked
+    VLC::Instance&                      m_instance;   // Used for every media of this producer
+    std::string                         m_resource;
+    std::shared_ptr<const MediaInfo>    m_info;
+    bool                                m_parking;
+
+    std::mutex                          m_openLock;
+    std::condition_variable             m_openCond;
+    bool                                m_opening;      // openAsync() is pending
+    std::atomic_bool                    m_cancelOpen;
+    WorkerPool::JobId                   m_openJob;      // Of openAsync(), in preparsePool()
+
+    // Taken by every call into the player, so neither side's thread uses it
+    // while the other rebuilds it. Goes before the queue locks.
+    std::mutex          m_playerLock;
     VLC::Media          m_media;
-    VLC::MediaPlayer    m_videoMediaPlayer;
-    VLC::MediaPlayer    m_audioMediaPlayer;
-
-    std::deque<std::shared_ptr<Frame>>  m_videoFrames;
-    std::deque<std::shared_ptr<Frame>>  m_audioFrames;
+    VLC::MediaPlayer    m_mediaPlayer;
+
+    // Filled by VLC's smem threads, read by the MLT render threads.
+    SPSCQueue<Frame>    m_videoFrames;
+    SPSCQueue<AudioChunk>   m_audioChunks;
+    AudioRing           m_audioRing;
+    uint8_t*            m_audioWriting;     // Where smem writes the current chunk
+    std::vector<uint8_t>    m_audioScratch; // Only touched by VLC's audio thread
+    int64_t             m_audioNextSample;  // Media sample of the next chunk, by the audio thread
+    std::atomic<int64_t>    m_audioHead;    // Media sample following the last chunk committed
+    std::atomic<uint32_t>   m_audioHeadGeneration;  // Of that chunk
+    int64_t             m_audioCursor;      // Media sample get_audio is up to, under m_audioLock
+    ReadAhead           m_videoReadAhead;
+    ReadAhead           m_audioReadAhead;
 
     int                 m_audioIndex;
     int                 m_videoIndex;
+    uint32_t            m_videoCodec;
 
-    u_int64_t           m_audioFramesTotalSize;
+    std::shared_ptr<KeyframeIndex>      m_keyframeIndex;    // Set under both queue locks
 
-    int                 m_videoLastPosition;
-    double              m_videoLastPositionReal;
     int                 m_audioLastPosition;
     mlt_position        m_audioExpected;
     mlt_position        m_videoExpected;
 
+    // Only serialise MLT threads consuming the same queue, the smem threads
+    // never take them.
     std::mutex          m_audioLock;
     std::mutex          m_videoLock;
 
-    bool                        m_isAudioFrameReady;
-    bool                        m_isVideoFrameReady;
-    bool                        m_isAudioTooManyFrames;
-    bool                        m_isVideoTooManyFrames;
-    std::condition_variable     m_videoFrameReadyCond;  // For m_isFrameReady
-    std::condition_variable     m_audioFrameReadyCond;  // For m_isFrameReady
-    std::condition_variable     m_videoTooManyFramesCond; // For m_isTooManyFrames
-    std::condition_variable     m_audioTooManyFramesCond; // For m_isTooManyFrames
-    std::atomic_bool            m_audioStopping;
-    std::atomic_bool            m_videoStopping;
-    u_int32_t           m_audioBufferLimit;
-    u_int32_t           m_videoBufferLimit;
+    std::atomic_bool            m_stopping;
+    std::atomic_int             m_decoderState;     // A DecoderState, set from VLC's event thread
+    const char*                 m_publishedState;   // decoder.state as last published
+    std::atomic_bool            m_videoStarving;    // get_image is waiting for a frame
+    std::atomic_bool            m_audioStarving;    // get_audio is waiting for samples
+    std::atomic<uint32_t>       m_seekGeneration;
+    uint32_t                    m_audioGeneration;  // Of the buffer in smem's hands
+    uint32_t                    m_videoGeneration;
+    uint32_t                    m_videoQueuedGeneration;    // Of the last frame queued, by the video thread
+
+    int64_t                     m_frameDuration;    // In microseconds
+    std::atomic<int64_t>        m_ptsOrigin;        // smem timestamp of media time 0, 0 if unknown
+    std::atomic<int64_t>        m_videoSeekTarget;  // Media time to drop frames until, -1 if none
+    std::atomic<int64_t>        m_audioSeekSample;  // Media sample the audio must start at, -1 if any will do
+    std::atomic_bool            m_hasSeeked;
+    mlt_position                m_seekPosition;     // Where the decoder last started, set under m_playerLock and the queue locks
+    std::atomic<int64_t>        m_videoHead;        // Media time of the newest decoded frame
+
+    int                 m_seekCount;
+    int                 m_seekAvoidedCount;
+
+    mlt_image_format    m_imageFormat;      // What smem outputs
+    bool                m_imageShown;
+    int                 m_formatRequests;   // Consecutive requests for another format or size
+    int                 m_decodeWidth;      // What smem scales to, 0 for the source size
+    int                 m_decodeHeight;
+    std::vector<std::string>    m_decoderOptions;   // What the current media was built with
+
+    std::unique_ptr<FrameCache> m_frameCache;       // Unless the global one is used
+    int                 m_cacheHits;
+    int                 m_cacheMisses;
+
+    float               m_rate;             // What VLC was last told
+    bool                m_audioShuttled;    // The last audio request was a silent one
+    std::mutex          m_reverseLock;      // Guards m_reverseFrames
+    std::deque<Frame>   m_reverseFrames;    // Decoded for reverse playback, in media order
+    std::mutex          m_lastImageLock;    // Guards m_lastImage and m_lastImageFormat
+    Frame               m_lastImage;        // Shown when nothing was decoded in time
+    mlt_image_format    m_lastImageFormat;
+
+    Metrics::Histogram  m_videoWait;        // get_image waiting for the decoder
+    Metrics::Histogram  m_audioWait;        // get_audio waiting for the decoder
+    Metrics::Histogram  m_decoderWait;      // smem waiting for room
+    Metrics::Counter    m_waitTimeouts;
+    Metrics::Counter    m_framesSkipped;    // Decoded but never shown
+    Metrics::Counter    m_framesRepeated;   // Shown again for the next position
+    Metrics::Set        m_metrics;          // Goes first, it points to the above
+    int64_t             m_lastShownPts;
+
+    static const int    FormatSwitchRequests = 25;
+    static const int    VideoQueueCapacity = 64;
+    static const int    AudioQueueCapacity = 512;
+    static const int    AudioRingSeconds = 16;
+    static const size_t IdlePipelines = 4;
+    static const size_t PreparseThreads = 4;
+    static const int64_t DefaultReadAheadBudget = 128 * 1024 * 1024;
+    static const int    DefaultReverseWindow = 25;
+    static const int    DefaultDecoderDeadline = 1000;  // In milliseconds
 };
 
 extern "C" mlt_producer producer_vlc_init_CXX( mlt_profile profile, mlt_service_type type , const char* id , char* arg )
 {
-    auto vlcProducer = new VLCProducer( profile, arg );
+    // "vlc-async" returns before the resource is preparsed.
+    const bool async = id != nullptr && strcmp( id, "vlc-async" ) == 0;
+
+    auto vlcProducer = VLCProducer::lease( profile, arg );
+    if ( vlcProducer == nullptr )
+        vlcProducer = new VLCProducer( profile, arg, nullptr, async );
     if ( vlcProducer->isValid() == true )
         return vlcProducer->producer();
+    else if ( vlcProducer->producer() != nullptr )
+    {
+        // Closing the producer purges the service cache, which deletes vlcProducer.
+        mlt_producer_close( vlcProducer->producer() );
+        return NULL;
+    }
     else
     {
         delete vlcProducer;
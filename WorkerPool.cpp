@@ -0,0 +1,87 @@
+/*****************************************************************************
+ * WorkerPool.cpp: Bounded pool of worker threads
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "WorkerPool.hpp"
+
+WorkerPool::WorkerPool( size_t size )
+    : m_size( size > 0 ? size : 1 )
+    , m_idle( 0 )
+    , m_stopping( false )
+    , m_nextId( 0 )
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lck( m_lock );
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+    for ( auto& thread : m_threads )
+        thread.join();
+}
+
+WorkerPool::JobId WorkerPool::submit( std::function<void()> job )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    const JobId id = m_nextId++;
+    m_jobs.emplace_back( id, std::move( job ) );
+    if ( m_idle == 0 && m_threads.size() < m_size )
+        m_threads.emplace_back( &WorkerPool::run, this );
+    else
+        m_cond.notify_one();
+    return id;
+}
+
+bool WorkerPool::cancel( JobId id )
+{
+    std::lock_guard<std::mutex> lck( m_lock );
+    for ( auto it = m_jobs.begin(); it != m_jobs.end(); ++it )
+    {
+        if ( it->first == id )
+        {
+            m_jobs.erase( it );
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkerPool::run()
+{
+    std::unique_lock<std::mutex> lck( m_lock );
+    for ( ;; )
+    {
+        m_idle++;
+        m_cond.wait( lck, [this]() { return m_jobs.empty() == false || m_stopping == true; } );
+        m_idle--;
+        if ( m_jobs.empty() == true )
+            return;
+
+        auto job = std::move( m_jobs.front().second );
+        m_jobs.pop_front();
+        lck.unlock();
+        job();
+        lck.lock();
+    }
+}
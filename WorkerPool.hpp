@@ -0,0 +1,64 @@
+/*****************************************************************************
+ * WorkerPool.hpp: Bounded pool of worker threads
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// Runs jobs in FIFO order on at most `size` threads, which are started as
+// jobs arrive and kept until the pool is destroyed.
+class WorkerPool
+{
+public:
+    explicit WorkerPool( size_t size );
+    ~WorkerPool();
+
+    WorkerPool( const WorkerPool& ) = delete;
+    WorkerPool& operator=( const WorkerPool& ) = delete;
+
+    typedef uint64_t JobId;
+
+    JobId submit( std::function<void()> job );
+    // Removes a job that hasn't started yet. False if it runs or ran already.
+    bool cancel( JobId id );
+
+private:
+    void run();
+
+    size_t                  m_size;
+    size_t                  m_idle;
+    bool                    m_stopping;
+    JobId                   m_nextId;
+    std::mutex              m_lock;
+    std::condition_variable m_cond;
+    std::deque<std::pair<JobId, std::function<void()>>> m_jobs;
+    std::vector<std::thread>            m_threads;
+};
+
+#endif // WORKERPOOL_HPP
@@ -0,0 +1,394 @@
+/*****************************************************************************
+ * vlc_bench.cpp: Throughput and latency benchmarks for the vlc module
+ *****************************************************************************
+ * Copyright (C) 2008-2016 Yikei Lu
+ *
+ * Authors: Yikei Lu    <luyikei.qmltu@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Runs scripted workloads against the vlc producer and consumer, loaded
+// through the MLT repository like any other module, and prints one JSON
+// object per workload:
+//
+//   MLT_REPOSITORY=/path/to/modules ./vlc_bench [options] [workload...]
+//
+// Workloads: linear, seek, scrub, reverse, many, encode. All of them by
+// default. The test clip is encoded with the vlc consumer from MLT's noise
+// producer unless one is given.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <mlt++/Mlt.h>
+
+namespace
+{
+
+struct Options
+{
+    Options()
+        : profile( "atsc_720p_25" )
+        , clip( "/tmp/mlt-vlc-bench.mkv" )
+        , frames( 500 )
+        , iterations( 100 )
+        , producers( 8 )
+        , seed( 1 )
+    {
+    }
+
+    std::string     profile;
+    std::string     clip;
+    std::string     output;
+    int             frames;         // Length of the generated clip
+    int             iterations;     // Seeks, scrub steps...
+    int             producers;
+    unsigned        seed;
+    std::vector<std::string>    workloads;
+};
+
+struct Result
+{
+    Result()
+        : frames( 0 )
+        , seconds( 0 )
+        , seeks( 0 )
+        , seeksAvoided( 0 )
+        , failures( 0 )
+    {
+    }
+
+    std::string     workload;
+    int             frames;
+    double          seconds;
+    std::vector<double> latencies;  // Per frame, in milliseconds
+    int             seeks;
+    int             seeksAvoided;
+    int             failures;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double milliseconds( Clock::duration duration )
+{
+    return std::chrono::duration<double, std::milli>( duration ).count();
+}
+
+double percentile( std::vector<double> values, double p )
+{
+    if ( values.empty() == true )
+        return 0;
+    std::sort( values.begin(), values.end() );
+    size_t index = std::min( values.size() - 1, ( size_t ) ( p * values.size() ) );
+    return values[index];
+}
+
+long residentKb()
+{
+    long pages = 0;
+    FILE* statm = fopen( "/proc/self/statm", "r" );
+    if ( statm != nullptr )
+    {
+        long size;
+        if ( fscanf( statm, "%ld %ld", &size, &pages ) != 2 )
+            pages = 0;
+        fclose( statm );
+    }
+    return pages * ( sysconf( _SC_PAGESIZE ) / 1024 );
+}
+
+long peakResidentKb()
+{
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_maxrss;
+}
+
+void print( FILE* out, const Result& result )
+{
+    fprintf( out, "{\"workload\": \"%s\", \"frames\": %d, \"seconds\": %.3f, \"fps\": %.2f, "
+                  "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+                  "\"seeks\": %d, \"seeks_avoided\": %d, \"failures\": %d, "
+                  "\"rss_kb\": %ld, \"peak_rss_kb\": %ld}\n",
+             result.workload.c_str(), result.frames, result.seconds,
+             result.seconds > 0 ? result.frames / result.seconds : 0,
+             percentile( result.latencies, 0.5 ), percentile( result.latencies, 0.99 ),
+             percentile( result.latencies, 1 ),
+             result.seeks, result.seeksAvoided, result.failures,
+             residentKb(), peakResidentKb() );
+    fflush( out );
+}
+
+// Fetches and renders the image of `position`, the way a consumer would.
+bool fetch( Mlt::Producer& producer, int position, Result& result )
+{
+    auto start = Clock::now();
+    producer.seek( position );
+    std::unique_ptr<Mlt::Frame> frame( producer.get_frame() );
+    bool ok = false;
+    if ( frame != nullptr )
+    {
+        mlt_image_format format = mlt_image_yuv420p;
+        int width = 0;
+        int height = 0;
+        ok = frame->get_image( format, width, height ) != nullptr;
+    }
+    result.latencies.push_back( milliseconds( Clock::now() - start ) );
+    result.frames++;
+    if ( ok == false )
+        result.failures++;
+    return ok;
+}
+
+void collectStats( Mlt::Producer& producer, Result& result )
+{
+    result.seeks += producer.get_int( "stats.seeks" );
+    result.seeksAvoided += producer.get_int( "stats.seeks_avoided" );
+}
+
+// Runs `workload` on a fresh producer of the clip.
+Result run( Mlt::Profile& profile, const Options& options, const char* name,
+            std::function<void( Mlt::Producer&, Result& )> workload )
+{
+    Result result;
+    result.workload = name;
+    Mlt::Producer producer( profile, "vlc", options.clip.c_str() );
+    if ( producer.is_valid() == false )
+    {
+        result.failures++;
+        return result;
+    }
+    auto start = Clock::now();
+    workload( producer, result );
+    result.seconds = milliseconds( Clock::now() - start ) / 1000;
+    collectStats( producer, result );
+    return result;
+}
+
+void onFrameShow( mlt_properties, std::atomic_int* shown, mlt_frame )
+{
+    ( *shown )++;
+}
+
+// Encodes `frames` frames of `producer` to `target` with the vlc consumer, as
+// fast as it goes.
+Result encode( Mlt::Profile& profile, Mlt::Producer& producer, const std::string& target, int frames )
+{
+    Result result;
+    result.workload = "encode";
+
+    Mlt::Consumer consumer( profile, "vlc", target.c_str() );
+    if ( consumer.is_valid() == false )
+    {
+        result.failures++;
+        return result;
+    }
+    consumer.set( "real_time", 0 );
+    producer.set_in_and_out( 0, frames - 1 );
+    consumer.connect( producer );
+
+    // The consumer runs until stopped, so count what VLC took.
+    std::atomic_int shown( 0 );
+    std::unique_ptr<Mlt::Event> event( consumer.listen( "consumer-frame-show", &shown,
+                                                        ( mlt_listener ) onFrameShow ) );
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::seconds( 60 + frames / 5 );
+    consumer.start();
+    while ( shown < 2 * frames && Clock::now() < deadline )
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    consumer.stop();
+
+    // Images and audio are shown separately.
+    result.frames = shown / 2;
+    result.seconds = milliseconds( Clock::now() - start ) / 1000;
+    if ( result.frames < frames )
+        result.failures = frames - result.frames;
+    return result;
+}
+
+bool prepareClip( Mlt::Profile& profile, const Options& options )
+{
+    if ( access( options.clip.c_str(), R_OK ) == 0 )
+        return true;
+    Mlt::Producer noise( profile, "noise" );
+    if ( noise.is_valid() == false )
+        return false;
+    return encode( profile, noise, options.clip, options.frames ).failures == 0;
+}
+
+void usage( const char* name )
+{
+    fprintf( stderr, "Usage: %s [--profile name] [--clip file] [--frames n] [--iterations n]\n"
+                     "       [--producers n] [--seed n] [--output file] [workload...]\n"
+                     "Workloads: linear seek scrub reverse many encode\n", name );
+}
+
+}
+
+int main( int argc, char** argv )
+{
+    Options options;
+    for ( int i = 1; i < argc; i++ )
+    {
+        const bool hasValue = i + 1 < argc;
+        if ( strcmp( argv[i], "--profile" ) == 0 && hasValue )
+            options.profile = argv[++i];
+        else if ( strcmp( argv[i], "--clip" ) == 0 && hasValue )
+            options.clip = argv[++i];
+        else if ( strcmp( argv[i], "--frames" ) == 0 && hasValue )
+            options.frames = std::max( atoi( argv[++i] ), 1 );
+        else if ( strcmp( argv[i], "--iterations" ) == 0 && hasValue )
+            options.iterations = std::max( atoi( argv[++i] ), 1 );
+        else if ( strcmp( argv[i], "--producers" ) == 0 && hasValue )
+            options.producers = std::max( atoi( argv[++i] ), 1 );
+        else if ( strcmp( argv[i], "--seed" ) == 0 && hasValue )
+            options.seed = strtoul( argv[++i], NULL, 10 );
+        else if ( strcmp( argv[i], "--output" ) == 0 && hasValue )
+            options.output = argv[++i];
+        else if ( argv[i][0] != '-' )
+            options.workloads.push_back( argv[i] );
+        else
+        {
+            usage( argv[0] );
+            return 2;
+        }
+    }
+    if ( options.workloads.empty() == true )
+        options.workloads = { "linear", "seek", "scrub", "reverse", "many", "encode" };
+
+    Mlt::Factory::init();
+    Mlt::Profile profile( options.profile.c_str() );
+
+    if ( prepareClip( profile, options ) == false )
+    {
+        fprintf( stderr, "Can't create %s. Is MLT_REPOSITORY set?\n", options.clip.c_str() );
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if ( options.output.empty() == false && ( out = fopen( options.output.c_str(), "w" ) ) == nullptr )
+    {
+        perror( options.output.c_str() );
+        return 1;
+    }
+
+    int status = 0;
+    std::mt19937 random( options.seed );
+    for ( const auto& workload : options.workloads )
+    {
+        Result result;
+        if ( workload == "linear" )
+        {
+            result = run( profile, options, "linear", [&]( Mlt::Producer& producer, Result& result ) {
+                for ( int position = 0; position < producer.get_length(); position++ )
+                    fetch( producer, position, result );
+            } );
+        }
+        else if ( workload == "seek" )
+        {
+            result = run( profile, options, "seek", [&]( Mlt::Producer& producer, Result& result ) {
+                std::uniform_int_distribution<int> positions( 0, producer.get_length() - 1 );
+                for ( int i = 0; i < options.iterations; i++ )
+                    fetch( producer, positions( random ), result );
+            } );
+        }
+        else if ( workload == "scrub" )
+        {
+            // Short hops back and forth around a playhead that moves forward.
+            result = run( profile, options, "scrub", [&]( Mlt::Producer& producer, Result& result ) {
+                std::uniform_int_distribution<int> hops( -15, 30 );
+                int position = 0;
+                for ( int i = 0; i < options.iterations; i++ )
+                {
+                    position = std::min( std::max( position + hops( random ), 0 ), producer.get_length() - 1 );
+                    fetch( producer, position, result );
+                }
+            } );
+        }
+        else if ( workload == "reverse" )
+        {
+            result = run( profile, options, "reverse", [&]( Mlt::Producer& producer, Result& result ) {
+                producer.set_speed( -1 );
+                for ( int position = producer.get_length() - 1; position >= 0; position-- )
+                    fetch( producer, position, result );
+                producer.set_speed( 0 );
+            } );
+        }
+        else if ( workload == "many" )
+        {
+            // Plays several producers of the same clip in lockstep, like a
+            // multicam timeline.
+            result.workload = "many";
+            std::vector<std::unique_ptr<Mlt::Producer>> producers;
+            for ( int i = 0; i < options.producers; i++ )
+            {
+                producers.emplace_back( new Mlt::Producer( profile, "vlc", options.clip.c_str() ) );
+                if ( producers.back()->is_valid() == false )
+                {
+                    fprintf( stderr, "Can't open %s\n", options.clip.c_str() );
+                    status = 1;
+                    break;
+                }
+            }
+            if ( status != 0 )
+                break;
+            auto start = Clock::now();
+            const int length = std::min( options.iterations, producers.front()->get_length() );
+            for ( int position = 0; position < length; position++ )
+                for ( auto& producer : producers )
+                    fetch( *producer, position, result );
+            result.seconds = milliseconds( Clock::now() - start ) / 1000;
+            for ( auto& producer : producers )
+                collectStats( *producer, result );
+        }
+        else if ( workload == "encode" )
+        {
+            Mlt::Producer producer( profile, "vlc", options.clip.c_str() );
+            if ( producer.is_valid() == false )
+            {
+                fprintf( stderr, "Can't open %s\n", options.clip.c_str() );
+                status = 1;
+                break;
+            }
+            result = encode( profile, producer, options.clip + ".encode.ts", producer.get_length() );
+            unlink( ( options.clip + ".encode.ts" ).c_str() );
+        }
+        else
+        {
+            fprintf( stderr, "Unknown workload %s\n", workload.c_str() );
+            continue;
+        }
+        print( out, result );
+    }
+
+    if ( out != stdout )
+        fclose( out );
+    Mlt::Factory::close();
+    return status;
+}
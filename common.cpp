@@ -1,8 +1,17 @@
 
+#include <new>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
 #include "common.hpp"
 
 const char * const argv[] = {
     "--verbose=1",
+    "--preparse-threads=4",
     "--no-skip-frames",
     "--text-renderer",
     "--no-sub-autodetect-file",
@@ -10,4 +19,123 @@ const char * const argv[] = {
     NULL,
 };
 
-VLC::Instance instance = VLC::Instance( 4, argv );
+const char* moduleSetting( const char* name )
+{
+    const char* value = mlt_environment( name );
+    if ( value == nullptr || value[0] == '\0' )
+        value = getenv( name );
+    return value != nullptr && value[0] != '\0' ? value : nullptr;
+}
+
+namespace
+{
+
+struct InstancePool
+{
+    struct Shard
+    {
+        std::once_flag once;
+        std::unique_ptr<VLC::Instance> instance;
+    };
+
+    InstancePool()
+        : size( 1 )
+        , next( 0 )
+        , byResource( false )
+    {
+        const char* count = moduleSetting( "MLT_VLC_INSTANCES" );
+        if ( count != nullptr && atoi( count ) > 0 )
+            size = atoi( count );
+        shards.reset( new Shard[size] );
+        const char* sharding = moduleSetting( "MLT_VLC_SHARDING" );
+        byResource = sharding != nullptr && strcmp( sharding, "hash" ) == 0;
+
+        // Without argv's terminating NULL.
+        for ( size_t i = 0; i < sizeof argv / sizeof *argv - 1; i++ )
+            arguments.push_back( argv[i] );
+        // Scanning the plugins is most of what creating an instance costs,
+        // so a farm may want to point every process at one warm cache.
+        const char* cache = moduleSetting( "MLT_VLC_PLUGINS_CACHE" );
+        if ( cache != nullptr )
+            arguments.push_back( atoi( cache ) != 0 ? "--plugins-cache" : "--no-plugins-cache" );
+        const char* reset = moduleSetting( "MLT_VLC_RESET_PLUGINS_CACHE" );
+        if ( reset != nullptr && atoi( reset ) != 0 )
+            arguments.push_back( "--reset-plugins-cache" );
+        const char* path = moduleSetting( "MLT_VLC_PLUGIN_PATH" );
+        if ( path != nullptr )
+            setenv( "VLC_PLUGIN_PATH", path, 0 );
+    }
+
+    size_t size;
+    std::unique_ptr<Shard[]> shards;
+    std::atomic_uint next;
+    bool byResource;
+    std::vector<const char*> arguments;
+};
+
+InstancePool& instancePool()
+{
+    static InstancePool pool;
+    return pool;
+}
+
+}
+
+VLC::Instance& vlcInstance( const std::string& resource )
+{
+    auto& pool = instancePool();
+    size_t index;
+    if ( pool.byResource == true && resource.empty() == false )
+        index = std::hash<std::string>()( resource ) % pool.size;
+    else
+        index = pool.next++ % pool.size;
+
+    // Nothing is created until the first producer or consumer asks for it,
+    // so merely loading the module stays cheap.
+    auto& shard = pool.shards[index];
+    std::call_once( shard.once, [&pool, &shard]() {
+        shard.instance.reset( new VLC::Instance( pool.arguments.size(), pool.arguments.data() ) );
+    } );
+    return *shard.instance;
+}
+
+std::atomic<int64_t> FrameBuffer::s_bytes( 0 );
+
+uint8_t* FrameBuffer::alloc( size_t size )
+{
+    auto data = static_cast<uint8_t*>( mlt_pool_alloc( size + HeaderSize ) );
+    if ( data == nullptr )
+        return nullptr;
+    new ( data ) Header();
+    reinterpret_cast<Header*>( data )->refs = 1;
+    reinterpret_cast<Header*>( data )->size = size;
+    s_bytes.fetch_add( size, std::memory_order_relaxed );
+    return data + HeaderSize;
+}
+
+uint8_t* FrameBuffer::ref( uint8_t* buffer )
+{
+    header( buffer )->refs++;
+    return buffer;
+}
+
+void FrameBuffer::release( void* buffer )
+{
+    if ( buffer == nullptr )
+        return;
+    if ( --header( buffer )->refs == 0 )
+    {
+        s_bytes.fetch_sub( header( buffer )->size, std::memory_order_relaxed );
+        mlt_pool_release( header( buffer ) );
+    }
+}
+
+int FrameBuffer::refCount( uint8_t* buffer )
+{
+    return header( buffer )->refs;
+}
+
+int64_t FrameBuffer::bytes()
+{
+    return s_bytes.load( std::memory_order_relaxed );
+}
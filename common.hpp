@@ -1,3 +1,55 @@
+#ifndef COMMON_HPP
+#define COMMON_HPP
+
+#include <atomic>
+#include <string>
+
+#include <framework/mlt.h>
 #include <vlcpp/vlc.hpp>
 
-extern VLC::Instance instance;
+// The libvlc instances of the module, created on first use. There are
+// MLT_VLC_INSTANCES of them (1 by default), so busy processes don't all
+// contend on one instance's locks. With MLT_VLC_SHARDING=hash the same
+// resource always gets the same instance, otherwise every call gets the next
+// one round-robin, so a producer or consumer asks once and keeps its instance
+// for all of its media.
+//
+// MLT_VLC_PLUGINS_CACHE (0 or 1), MLT_VLC_RESET_PLUGINS_CACHE and
+// MLT_VLC_PLUGIN_PATH control where and whether libvlc caches its plugin
+// scan.
+VLC::Instance& vlcInstance( const std::string& resource = std::string() );
+
+// A process-wide setting of the module: the MLT environment property
+// `name`, or else the environment variable. nullptr if neither is set.
+const char* moduleSetting( const char* name );
+
+// Reference counted buffers allocated from mlt_pool. The count is stored in
+// front of the data, so the data pointer is all that's needed to release a
+// buffer and release() can be given to MLT as an mlt_destructor.
+class FrameBuffer
+{
+public:
+    static uint8_t* alloc( size_t size );
+    static uint8_t* ref( uint8_t* buffer );
+    static void release( void* buffer );
+    static int refCount( uint8_t* buffer );
+    // Bytes held by all the buffers alive.
+    static int64_t bytes();
+
+private:
+    struct Header
+    {
+        std::atomic_int refs;
+        size_t size;
+    };
+    static std::atomic<int64_t> s_bytes;
+    // Keeps the data as aligned as mlt_pool returns it.
+    static const size_t HeaderSize = 32;
+
+    static Header* header( void* buffer )
+    {
+        return reinterpret_cast<Header*>( static_cast<uint8_t*>( buffer ) - HeaderSize );
+    }
+};
+
+#endif // COMMON_HPP
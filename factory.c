@@ -41,4 +41,6 @@ MLT_REPOSITORY
     MLT_REGISTER_METADATA( consumer_type, "vlc", metadata, "consumer_vlc.yml" );
     MLT_REGISTER( producer_type, "vlc", producer_vlc_init );
     MLT_REGISTER_METADATA( producer_type, "vlc", metadata, "producer_vlc.yml" );
+    MLT_REGISTER( producer_type, "vlc-async", producer_vlc_init );
+    MLT_REGISTER_METADATA( producer_type, "vlc-async", metadata, "producer_vlc.yml" );
 }